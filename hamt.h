@@ -0,0 +1,371 @@
+/*
+ * Implements a generic persistent hash array mapped trie.
+ * Every node is reference counted. put and remove copy the path from the root to the changed leaf and share every
+ * other node with the previous version, so taking a snapshot is O(1) and there is never a resize. Nodes referenced
+ * by a single version are updated in place instead of copied, so a map without snapshots does not pay for copies.
+ * Usage
+ * =====
+ * HAMT_DECLARE(K, V)
+ *     Defines structures hamt_K_V and its nodes, and declares the functions.
+ *     If K or V is a pointer, then it has to be typedef'd.
+ * HAMT_DEFINE(K, V, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ *
+ * A hamt_K_V is modified by one thread at a time. Snapshots are independent hamt_K_V values that can be read,
+ * modified and destroyed on other threads, since reference counts are updated atomically.
+ *
+ * Functions
+ * =========
+ * void hamt_K_V_init(hamt_K_V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value)):
+ *     Initiates an empty map. Destructors can be NULL in which case they are ignored.
+ *
+ * void hamt_K_V_put(hamt_K_V *h, const K *key, const V *value):
+ *     Puts the key with the value, both copied bitwise. The map owns the copies even if the key was present, in which
+ *     case the previous key and value are destroyed once no snapshot refers to them.
+ *
+ * const V *hamt_K_V_get(const hamt_K_V *h, const K *key):
+ *     Gets a pointer to the value associated with the key; returns NULL if it doesn't exist.
+ *     Values may be shared with snapshots, so they must not be modified.
+ *
+ * bool hamt_K_V_remove(hamt_K_V *h, const K *key):
+ *     Removes the key from the map. Returns true if removed, false if it doesn't exist.
+ *
+ * void hamt_K_V_snapshot(hamt_K_V *dst, const hamt_K_V *src):
+ *     Initiates dst as a snapshot of src in O(1). The two maps are independent afterwards.
+ *
+ * void hamt_K_V_for_each(const hamt_K_V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx):
+ *     Calls fn on every key and value.
+ *
+ * void hamt_K_V_destroy(hamt_K_V *h):
+ *     Releases the map. Nodes are freed, and keys and values destroyed, once no snapshot refers to them.
+ *
+ * Example
+ * =======
+ * HAMT_DECLARE(int, int)
+ * HAMT_DEFINE(int, int, hash_func, eq_func)
+ *
+ * hamt_int_int h, snap;
+ * hamt_int_int_init(&h, NULL, NULL);
+ * hamt_int_int_put(&h, &(int){1}, &(int){2});
+ * hamt_int_int_snapshot(&snap, &h);
+ * hamt_int_int_put(&h, &(int){1}, &(int){3});
+ * printf("%d %d", *hamt_int_int_get(&snap, &(int){1}), *hamt_int_int_get(&h, &(int){1})); // 2 3
+ * hamt_int_int_destroy(&snap);
+ * hamt_int_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmap.h"
+
+#define HAMT_BITS 5
+#define HAMT_MASK ((1u << HAMT_BITS) - 1)
+
+enum {
+    HAMT_LEAF,
+    HAMT_BRANCH,
+    /* leaves whose 32 bit hashes are all equal */
+    HAMT_COLLISION,
+};
+
+#define HAMT_DECLARE(K, V) \
+typedef struct hamt_##K##_##V##_node {\
+    uint32_t refcount;\
+    uint32_t kind;\
+} hamt_##K##_##V##_node;\
+\
+typedef struct hamt_##K##_##V##_leaf {\
+    hamt_##K##_##V##_node base;\
+    uint32_t              hash;\
+    K                     key;\
+    V                     value;\
+} hamt_##K##_##V##_leaf;\
+\
+typedef struct hamt_##K##_##V##_branch {\
+    hamt_##K##_##V##_node base;\
+    /* bit i is set if the child for hash chunk i exists; unused by collision nodes */\
+    uint32_t              bitmap;\
+    uint32_t              count;\
+    hamt_##K##_##V##_node *children[];\
+} hamt_##K##_##V##_branch;\
+\
+typedef struct hamt_##K##_##V {\
+    uint32_t              len;\
+    void                  (*key_destructor)(K *key);\
+    void                  (*value_destructor)(V *value);\
+    hamt_##K##_##V##_node *root;\
+} hamt_##K##_##V;\
+\
+void     hamt_##K##_##V##_init(hamt_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value));\
+void     hamt_##K##_##V##_put(hamt_##K##_##V *h, const K *key, const V *value);\
+const V *hamt_##K##_##V##_get(const hamt_##K##_##V *h, const K *key);\
+bool     hamt_##K##_##V##_remove(hamt_##K##_##V *h, const K *key);\
+void     hamt_##K##_##V##_snapshot(hamt_##K##_##V *dst, const hamt_##K##_##V *src);\
+void     hamt_##K##_##V##_for_each(const hamt_##K##_##V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx);\
+void     hamt_##K##_##V##_destroy(hamt_##K##_##V *h);
+
+#define HAMT_DEFINE(K, V, hash_func, eq_func)\
+void hamt_##K##_##V##_init(hamt_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value))\
+{\
+    h->len = 0;\
+    h->key_destructor = key_destructor;\
+    h->value_destructor = value_destructor;\
+    h->root = NULL;\
+}\
+\
+static uint32_t hamt_##K##_##V##_hash(const K *key) \
+{\
+    /* every 5 bit chunk depends on the whole hash */\
+    return hmap_mix(hash_func(key));\
+}\
+\
+static void hamt_##K##_##V##_incref(hamt_##K##_##V##_node *n)\
+{\
+    __atomic_fetch_add(&n->refcount, 1, __ATOMIC_RELAXED);\
+}\
+\
+static void hamt_##K##_##V##_decref(const hamt_##K##_##V *h, hamt_##K##_##V##_node *n)\
+{\
+    if (n == NULL || __atomic_sub_fetch(&n->refcount, 1, __ATOMIC_ACQ_REL) != 0)\
+        return;\
+    if (n->kind == HAMT_LEAF) {\
+        hamt_##K##_##V##_leaf *leaf = (hamt_##K##_##V##_leaf *)n;\
+        if (h->key_destructor != NULL) h->key_destructor(&leaf->key);\
+        if (h->value_destructor != NULL) h->value_destructor(&leaf->value);\
+    } else {\
+        hamt_##K##_##V##_branch *b = (hamt_##K##_##V##_branch *)n;\
+        for (uint32_t i = 0; i < b->count; i++)\
+            hamt_##K##_##V##_decref(h, b->children[i]);\
+    }\
+    free(n);\
+}\
+\
+static hamt_##K##_##V##_branch *hamt_##K##_##V##_new_branch(uint32_t kind, uint32_t bitmap, uint32_t count)\
+{\
+    hamt_##K##_##V##_branch *b = malloc(sizeof(*b) + count * sizeof(b->children[0]));\
+    b->base.refcount = 1;\
+    b->base.kind = kind;\
+    b->bitmap = bitmap;\
+    b->count = count;\
+    return b;\
+}\
+\
+/* returns b if this reference is the only one, otherwise a private copy, consuming the reference to b */\
+static hamt_##K##_##V##_branch *hamt_##K##_##V##_unique(const hamt_##K##_##V *h, hamt_##K##_##V##_branch *b)\
+{\
+    if (__atomic_load_n(&b->base.refcount, __ATOMIC_ACQUIRE) == 1)\
+        return b;\
+    hamt_##K##_##V##_branch *copy = hamt_##K##_##V##_new_branch(b->base.kind, b->bitmap, b->count);\
+    for (uint32_t i = 0; i < b->count; i++) {\
+        copy->children[i] = b->children[i];\
+        hamt_##K##_##V##_incref(b->children[i]);\
+    }\
+    hamt_##K##_##V##_decref(h, &b->base);\
+    return copy;\
+}\
+\
+/* returns b with room for one more child at pos */\
+static hamt_##K##_##V##_branch *hamt_##K##_##V##_insert_child(hamt_##K##_##V##_branch *b, uint32_t pos, hamt_##K##_##V##_node *child)\
+{\
+    b = realloc(b, sizeof(*b) + (b->count + 1) * sizeof(b->children[0]));\
+    memmove(&b->children[pos + 1], &b->children[pos], (b->count - pos) * sizeof(b->children[0]));\
+    b->children[pos] = child;\
+    b->count++;\
+    return b;\
+}\
+\
+/* builds the smallest subtree at shift holding the two leaves with different keys */\
+static hamt_##K##_##V##_node *hamt_##K##_##V##_pair(hamt_##K##_##V##_leaf *a, hamt_##K##_##V##_leaf *b, uint32_t shift)\
+{\
+    if (shift >= 32) {\
+        hamt_##K##_##V##_branch *c = hamt_##K##_##V##_new_branch(HAMT_COLLISION, 0, 2);\
+        c->children[0] = &a->base;\
+        c->children[1] = &b->base;\
+        return &c->base;\
+    }\
+    uint32_t ia = (a->hash >> shift) & HAMT_MASK;\
+    uint32_t ib = (b->hash >> shift) & HAMT_MASK;\
+    if (ia == ib) {\
+        hamt_##K##_##V##_branch *n = hamt_##K##_##V##_new_branch(HAMT_BRANCH, 1u << ia, 1);\
+        n->children[0] = hamt_##K##_##V##_pair(a, b, shift + HAMT_BITS);\
+        return &n->base;\
+    }\
+    hamt_##K##_##V##_branch *n = hamt_##K##_##V##_new_branch(HAMT_BRANCH, (1u << ia) | (1u << ib), 2);\
+    n->children[ia < ib ? 0 : 1] = &a->base;\
+    n->children[ia < ib ? 1 : 0] = &b->base;\
+    return &n->base;\
+}\
+\
+/* puts leaf into the subtree n at shift, consuming the references to both; sets *added if the key was new */\
+static hamt_##K##_##V##_node *hamt_##K##_##V##_assoc(const hamt_##K##_##V *h, hamt_##K##_##V##_node *n, uint32_t shift, hamt_##K##_##V##_leaf *leaf, bool *added)\
+{\
+    if (n == NULL) {\
+        *added = true;\
+        return &leaf->base;\
+    }\
+    if (n->kind == HAMT_LEAF) {\
+        hamt_##K##_##V##_leaf *old = (hamt_##K##_##V##_leaf *)n;\
+        if (old->hash == leaf->hash && eq_func(&old->key, &leaf->key)) {\
+            hamt_##K##_##V##_decref(h, n);\
+            return &leaf->base;\
+        }\
+        *added = true;\
+        return hamt_##K##_##V##_pair(old, leaf, shift);\
+    }\
+    hamt_##K##_##V##_branch *b = hamt_##K##_##V##_unique(h, (hamt_##K##_##V##_branch *)n);\
+    if (b->base.kind == HAMT_COLLISION) {\
+        for (uint32_t i = 0; i < b->count; i++) {\
+            hamt_##K##_##V##_leaf *old = (hamt_##K##_##V##_leaf *)b->children[i];\
+            if (eq_func(&old->key, &leaf->key)) {\
+                hamt_##K##_##V##_decref(h, &old->base);\
+                b->children[i] = &leaf->base;\
+                return &b->base;\
+            }\
+        }\
+        *added = true;\
+        return &hamt_##K##_##V##_insert_child(b, b->count, &leaf->base)->base;\
+    }\
+    uint32_t bit = 1u << ((leaf->hash >> shift) & HAMT_MASK);\
+    uint32_t pos = __builtin_popcount(b->bitmap & (bit - 1));\
+    if (!(b->bitmap & bit)) {\
+        *added = true;\
+        b = hamt_##K##_##V##_insert_child(b, pos, &leaf->base);\
+        b->bitmap |= bit;\
+        return &b->base;\
+    }\
+    b->children[pos] = hamt_##K##_##V##_assoc(h, b->children[pos], shift + HAMT_BITS, leaf, added);\
+    return &b->base;\
+}\
+\
+/* removes a key known to be present from the subtree n at shift, consuming the reference to n */\
+static hamt_##K##_##V##_node *hamt_##K##_##V##_dissoc(const hamt_##K##_##V *h, hamt_##K##_##V##_node *n, uint32_t shift, const K *key, uint32_t hash)\
+{\
+    if (n->kind == HAMT_LEAF) {\
+        hamt_##K##_##V##_decref(h, n);\
+        return NULL;\
+    }\
+    hamt_##K##_##V##_branch *b = hamt_##K##_##V##_unique(h, (hamt_##K##_##V##_branch *)n);\
+    uint32_t pos = 0;\
+    uint32_t bit = 0;\
+    if (b->base.kind == HAMT_COLLISION) {\
+        while (!eq_func(&((hamt_##K##_##V##_leaf *)b->children[pos])->key, key))\
+            pos++;\
+    } else {\
+        bit = 1u << ((hash >> shift) & HAMT_MASK);\
+        pos = __builtin_popcount(b->bitmap & (bit - 1));\
+    }\
+    hamt_##K##_##V##_node *child = hamt_##K##_##V##_dissoc(h, b->children[pos], shift + HAMT_BITS, key, hash);\
+    if (child != NULL) {\
+        b->children[pos] = child;\
+        return &b->base;\
+    }\
+    b->bitmap &= ~bit;\
+    b->count--;\
+    memmove(&b->children[pos], &b->children[pos + 1], (b->count - pos) * sizeof(b->children[0]));\
+    /* a lone leaf moves up to replace its parent, keeping the trie as shallow as possible */\
+    if (b->count == 1 && b->children[0]->kind == HAMT_LEAF) {\
+        child = b->children[0];\
+        free(b);\
+        return child;\
+    }\
+    if (b->count == 0) {\
+        free(b);\
+        return NULL;\
+    }\
+    return &b->base;\
+}\
+\
+static hamt_##K##_##V##_leaf *hamt_##K##_##V##_find(const hamt_##K##_##V *h, const K *key, uint32_t hash)\
+{\
+    hamt_##K##_##V##_node *n = h->root;\
+    for (uint32_t shift = 0; n != NULL; shift += HAMT_BITS) {\
+        if (n->kind == HAMT_LEAF) {\
+            hamt_##K##_##V##_leaf *leaf = (hamt_##K##_##V##_leaf *)n;\
+            return leaf->hash == hash && eq_func(&leaf->key, key) ? leaf : NULL;\
+        }\
+        hamt_##K##_##V##_branch *b = (hamt_##K##_##V##_branch *)n;\
+        if (b->base.kind == HAMT_COLLISION) {\
+            for (uint32_t i = 0; i < b->count; i++) {\
+                hamt_##K##_##V##_leaf *leaf = (hamt_##K##_##V##_leaf *)b->children[i];\
+                if (leaf->hash == hash && eq_func(&leaf->key, key))\
+                    return leaf;\
+            }\
+            return NULL;\
+        }\
+        uint32_t bit = 1u << ((hash >> shift) & HAMT_MASK);\
+        if (!(b->bitmap & bit))\
+            return NULL;\
+        n = b->children[__builtin_popcount(b->bitmap & (bit - 1))];\
+    }\
+    return NULL;\
+}\
+\
+void hamt_##K##_##V##_put(hamt_##K##_##V *h, const K *key, const V *value)\
+{\
+    hamt_##K##_##V##_leaf *leaf = malloc(sizeof(*leaf));\
+    leaf->base.refcount = 1;\
+    leaf->base.kind = HAMT_LEAF;\
+    leaf->hash = hamt_##K##_##V##_hash(key);\
+    leaf->key = *key;\
+    leaf->value = *value;\
+    bool added = false;\
+    h->root = hamt_##K##_##V##_assoc(h, h->root, 0, leaf, &added);\
+    if (added)\
+        h->len++;\
+}\
+\
+const V *hamt_##K##_##V##_get(const hamt_##K##_##V *h, const K *key)\
+{\
+    hamt_##K##_##V##_leaf *leaf = hamt_##K##_##V##_find(h, key, hamt_##K##_##V##_hash(key));\
+    return leaf != NULL ? &leaf->value : NULL;\
+}\
+\
+bool hamt_##K##_##V##_remove(hamt_##K##_##V *h, const K *key)\
+{\
+    uint32_t hash = hamt_##K##_##V##_hash(key);\
+    if (hamt_##K##_##V##_find(h, key, hash) == NULL)\
+        return false;\
+    h->root = hamt_##K##_##V##_dissoc(h, h->root, 0, key, hash);\
+    h->len--;\
+    return true;\
+}\
+\
+void hamt_##K##_##V##_snapshot(hamt_##K##_##V *dst, const hamt_##K##_##V *src)\
+{\
+    *dst = *src;\
+    if (dst->root != NULL)\
+        hamt_##K##_##V##_incref(dst->root);\
+}\
+\
+static void hamt_##K##_##V##_walk(const hamt_##K##_##V##_node *n, void (*fn)(const K *key, const V *value, void *ctx), void *ctx)\
+{\
+    if (n->kind == HAMT_LEAF) {\
+        const hamt_##K##_##V##_leaf *leaf = (const hamt_##K##_##V##_leaf *)n;\
+        fn(&leaf->key, &leaf->value, ctx);\
+        return;\
+    }\
+    const hamt_##K##_##V##_branch *b = (const hamt_##K##_##V##_branch *)n;\
+    for (uint32_t i = 0; i < b->count; i++)\
+        hamt_##K##_##V##_walk(b->children[i], fn, ctx);\
+}\
+\
+void hamt_##K##_##V##_for_each(const hamt_##K##_##V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx)\
+{\
+    if (h->root != NULL)\
+        hamt_##K##_##V##_walk(h->root, fn, ctx);\
+}\
+\
+void hamt_##K##_##V##_destroy(hamt_##K##_##V *h)\
+{\
+    hamt_##K##_##V##_decref(h, h->root);\
+    h->root = NULL;\
+    h->len = 0;\
+}
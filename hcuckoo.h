@@ -0,0 +1,380 @@
+/*
+ * Implements a generic bucketized cuckoo hashmap.
+ * Every key lives in one of two buckets of HCUCKOO_SLOTS slots, so a lookup reads at most two buckets (plus a small
+ * stash that is empty almost always). An insert into two full buckets searches breadth first for the shortest chain
+ * of keys to move to their other bucket. There are no per-entry allocations or next pointers, and tables run
+ * safely at 95% occupancy.
+ * Keys with equal hashes share their two buckets, so at most 2 * HCUCKOO_SLOTS + HCUCKOO_STASH of them fit, whatever
+ * the size of the table. Rather than growing without end, put fails once more keys collide, which for keys from
+ * untrusted input calls for a seeded hash_func.
+ * Usage
+ * =====
+ * HCUCKOO_DECLARE(K, V)
+ *     Defines structure hcuckoo_K_V, and declares the functions.
+ *     If K or V is a pointer, then it has to be typedef'd.
+ * HCUCKOO_DEFINE(K, V, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ *
+ * Functions
+ * =========
+ * void hcuckoo_K_V_init_custom(hcuckoo_K_V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value)):
+ *     Initiates the hashmap with given parameters. initial capacity is rounded to next power of 2 and to at least two
+ *     buckets. load_factor must be at most 1. Destructors can be NULL in which case they are ignored.
+ *
+ * void hcuckoo_K_V_init(hcuckoo_K_V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value)):
+ *     init_custom with default parameters + destructors forwarded.
+ *
+ * V *hcuckoo_K_V_put(hcuckoo_K_V *h, const K *key):
+ *     Puts the key, returning a pointer to the value.
+ *     Entries move when the map is modified, so the pointer is only valid until the next put or remove.
+ *     Returns NULL, leaving the map unchanged, if the key cannot be placed: too many keys share its hash, or the
+ *     table cannot grow.
+ *
+ * V *hcuckoo_K_V_get(const hcuckoo_K_V *h, const K *key):
+ *     Gets a pointer to the value associated with the key; returns NULL if it doesn't exist.
+ *
+ * bool hcuckoo_K_V_remove(hcuckoo_K_V *h, const K *key):
+ *     Removes the key from the map, calling destructors for key and value.
+ *     Returns true if removed, false if it doesn't exist.
+ *
+ * void hcuckoo_K_V_for_each(hcuckoo_K_V *h, void (*fn)(const K *key, V *value, void *ctx), void *ctx):
+ *     Calls fn on every key and value. Modifying the hashmap or key is forbidden.
+ *
+ * void hcuckoo_K_V_destroy(hcuckoo_K_V *h):
+ *     Destroys the map by freeing memory, and calling destructors of keys and values.
+ *
+ * Example
+ * =======
+ * HCUCKOO_DECLARE(int, int)
+ * HCUCKOO_DEFINE(int, int, hash_func, eq_func)
+ *
+ * hcuckoo_int_int h;
+ * hcuckoo_int_int_init(&h, NULL, NULL);
+ * *hcuckoo_int_int_put(&h, &(int){1}) = 2;
+ * printf("%d", *hcuckoo_int_int_get(&h, &(int){1})); // 2
+ * hcuckoo_int_int_remove(&h, &(int){1});
+ * hcuckoo_int_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hmap.h"
+
+#define HCUCKOO_DEFAULT_LOAD_FACTOR      0.95
+#define HCUCKOO_DEFAULT_INITIAL_CAPACITY 16
+#define HCUCKOO_SLOTS                    4
+#define HCUCKOO_STASH                    4
+/* buckets examined by the breadth first search before an insert gives up and uses the stash */
+#define HCUCKOO_BFS_MAX                  256
+/* doublings tried by a grow whose rebuild fails before it gives up */
+#define HCUCKOO_GROW_TRIES               3
+
+/* stored hashes always have this bit set, so that 0 can mark an empty slot */
+#define HCUCKOO_HASH_USED 0x80000000u
+
+#define HCUCKOO_DECLARE(K, V) \
+typedef struct hcuckoo_##K##_##V##_bucket {\
+    uint32_t hashes[HCUCKOO_SLOTS];\
+    K        keys[HCUCKOO_SLOTS];\
+    V        values[HCUCKOO_SLOTS];\
+} hcuckoo_##K##_##V##_bucket;\
+\
+typedef struct hcuckoo_##K##_##V {\
+    uint32_t                   len;\
+    uint32_t                   cap;\
+    float                      load_factor;\
+    uint32_t                   threshold;\
+    uint32_t                   bits;\
+    uint32_t                   stash_len;\
+    void                       (*key_destructor)(K *key);\
+    void                       (*value_destructor)(V *value);\
+    hcuckoo_##K##_##V##_bucket *buckets;\
+    uint32_t                   stash_hashes[HCUCKOO_STASH];\
+    K                          stash_keys[HCUCKOO_STASH];\
+    V                          stash_values[HCUCKOO_STASH];\
+} hcuckoo_##K##_##V;\
+\
+void hcuckoo_##K##_##V##_init_custom(hcuckoo_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value));\
+void hcuckoo_##K##_##V##_init(hcuckoo_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value));\
+V   *hcuckoo_##K##_##V##_put(hcuckoo_##K##_##V *h, const K *key);\
+V   *hcuckoo_##K##_##V##_get(const hcuckoo_##K##_##V *h, const K *key);\
+bool hcuckoo_##K##_##V##_remove(hcuckoo_##K##_##V *h, const K *key);\
+void hcuckoo_##K##_##V##_for_each(hcuckoo_##K##_##V *h, void (*fn)(const K *key, V *value, void *ctx), void *ctx);\
+void hcuckoo_##K##_##V##_destroy(hcuckoo_##K##_##V *h);
+
+#define HCUCKOO_DEFINE(K, V, hash_func, eq_func)\
+static void hcuckoo_##K##_##V##_alloc(hcuckoo_##K##_##V *h, uint32_t buckets)\
+{\
+    h->cap = buckets * HCUCKOO_SLOTS;\
+    h->threshold = h->load_factor * h->cap;\
+    h->bits = 0;\
+    while ((1u << h->bits) < buckets)\
+        h->bits++;\
+    h->stash_len = 0;\
+    h->buckets = calloc(buckets, sizeof(*h->buckets));\
+}\
+\
+void hcuckoo_##K##_##V##_init_custom(hcuckoo_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value))\
+{\
+    h->len = 0;\
+    uint32_t buckets = 2;\
+    while (buckets * HCUCKOO_SLOTS < initial_capacity)\
+        buckets <<= 1;\
+    h->load_factor = load_factor;\
+    h->key_destructor = key_destructor;\
+    h->value_destructor = value_destructor;\
+    hcuckoo_##K##_##V##_alloc(h, buckets);\
+}\
+\
+void hcuckoo_##K##_##V##_init(hcuckoo_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value))\
+{\
+    hcuckoo_##K##_##V##_init_custom(h, HCUCKOO_DEFAULT_LOAD_FACTOR, HCUCKOO_DEFAULT_INITIAL_CAPACITY, key_destructor, value_destructor);\
+}\
+\
+static uint32_t hcuckoo_##K##_##V##_hash(const K *key) \
+{\
+    return hmap_mix(hash_func(key)) | HCUCKOO_HASH_USED;\
+}\
+\
+/* the two buckets come from the low bits of the hash and from the top bits of its fibonacci product */\
+static inline uint32_t hcuckoo_##K##_##V##_index1(const hcuckoo_##K##_##V *h, uint32_t hash)\
+{\
+    return hash & ((1u << h->bits) - 1);\
+}\
+\
+static inline uint32_t hcuckoo_##K##_##V##_index2(const hcuckoo_##K##_##V *h, uint32_t hash)\
+{\
+    return (hash * 0x9e3779b1u) >> (32 - h->bits);\
+}\
+\
+static inline uint32_t hcuckoo_##K##_##V##_other(const hcuckoo_##K##_##V *h, uint32_t bucket, uint32_t hash)\
+{\
+    uint32_t i1 = hcuckoo_##K##_##V##_index1(h, hash);\
+    return bucket == i1 ? hcuckoo_##K##_##V##_index2(h, hash) : i1;\
+}\
+\
+static int hcuckoo_##K##_##V##_find_in(const hcuckoo_##K##_##V##_bucket *b, const K *key, uint32_t hash)\
+{\
+    for (int s = 0; s < HCUCKOO_SLOTS; s++) {\
+        if (b->hashes[s] == hash && eq_func(&b->keys[s], key))\
+            return s;\
+    }\
+    return -1;\
+}\
+\
+static int hcuckoo_##K##_##V##_empty_in(const hcuckoo_##K##_##V##_bucket *b)\
+{\
+    for (int s = 0; s < HCUCKOO_SLOTS; s++) {\
+        if (b->hashes[s] == 0)\
+            return s;\
+    }\
+    return -1;\
+}\
+\
+typedef struct hcuckoo_##K##_##V##_loc {\
+    uint32_t *hash;\
+    K        *key;\
+    V        *value;\
+} hcuckoo_##K##_##V##_loc;\
+\
+static hcuckoo_##K##_##V##_loc hcuckoo_##K##_##V##_find(const hcuckoo_##K##_##V *h, const K *key, uint32_t hash)\
+{\
+    uint32_t i[2] = {hcuckoo_##K##_##V##_index1(h, hash), hcuckoo_##K##_##V##_index2(h, hash)};\
+    for (int n = 0; n < 2; n++) {\
+        hcuckoo_##K##_##V##_bucket *b = &h->buckets[i[n]];\
+        int s = hcuckoo_##K##_##V##_find_in(b, key, hash);\
+        if (s >= 0)\
+            return (hcuckoo_##K##_##V##_loc){&b->hashes[s], &b->keys[s], &b->values[s]};\
+    }\
+    hcuckoo_##K##_##V *m = (hcuckoo_##K##_##V *)h;\
+    for (uint32_t s = 0; s < h->stash_len; s++) {\
+        if (h->stash_hashes[s] == hash && eq_func(&h->stash_keys[s], key))\
+            return (hcuckoo_##K##_##V##_loc){&m->stash_hashes[s], &m->stash_keys[s], &m->stash_values[s]};\
+    }\
+    return (hcuckoo_##K##_##V##_loc){NULL, NULL, NULL};\
+}\
+\
+/* finds the shortest chain of moves freeing a slot in one of the buckets of hash, performs it, and returns the \
+ * freed slot; NULL if none was found within HCUCKOO_BFS_MAX buckets */\
+static hcuckoo_##K##_##V##_loc hcuckoo_##K##_##V##_make_room(hcuckoo_##K##_##V *h, uint32_t hash)\
+{\
+    struct { uint32_t bucket; int parent; int slot; } queue[HCUCKOO_BFS_MAX];\
+    int head = 0, tail = 0;\
+    queue[tail++] = (typeof(queue[0])){hcuckoo_##K##_##V##_index1(h, hash), -1, -1};\
+    queue[tail++] = (typeof(queue[0])){hcuckoo_##K##_##V##_index2(h, hash), -1, -1};\
+    for (; head < tail; head++) {\
+        hcuckoo_##K##_##V##_bucket *b = &h->buckets[queue[head].bucket];\
+        int empty = hcuckoo_##K##_##V##_empty_in(b);\
+        if (empty >= 0) {\
+            /* walk back to the root, moving each key on the path into the slot freed after it */\
+            for (int n = head; queue[n].parent >= 0; n = queue[n].parent) {\
+                hcuckoo_##K##_##V##_bucket *to = &h->buckets[queue[n].bucket];\
+                hcuckoo_##K##_##V##_bucket *from = &h->buckets[queue[queue[n].parent].bucket];\
+                int s = queue[n].slot;\
+                to->hashes[empty] = from->hashes[s];\
+                to->keys[empty] = from->keys[s];\
+                to->values[empty] = from->values[s];\
+                from->hashes[s] = 0;\
+                empty = s;\
+                head = queue[n].parent;\
+            }\
+            b = &h->buckets[queue[head].bucket];\
+            return (hcuckoo_##K##_##V##_loc){&b->hashes[empty], &b->keys[empty], &b->values[empty]};\
+        }\
+        for (int s = 0; s < HCUCKOO_SLOTS && tail < HCUCKOO_BFS_MAX; s++) {\
+            uint32_t alt = hcuckoo_##K##_##V##_other(h, queue[head].bucket, b->hashes[s]);\
+            /* a bucket may appear only once on a path, or a move would overwrite an earlier one */\
+            bool on_path = false;\
+            for (int n = head; n >= 0 && !on_path; n = queue[n].parent)\
+                on_path = queue[n].bucket == alt;\
+            if (!on_path)\
+                queue[tail++] = (typeof(queue[0])){alt, head, s};\
+        }\
+    }\
+    return (hcuckoo_##K##_##V##_loc){NULL, NULL, NULL};\
+}\
+\
+/* inserts a key known to be absent; NULL if the table is too full */\
+static V *hcuckoo_##K##_##V##_insert_new(hcuckoo_##K##_##V *h, const K *key, uint32_t hash)\
+{\
+    hcuckoo_##K##_##V##_loc loc = hcuckoo_##K##_##V##_make_room(h, hash);\
+    if (loc.hash == NULL) {\
+        if (h->stash_len == HCUCKOO_STASH)\
+            return NULL;\
+        uint32_t s = h->stash_len++;\
+        loc = (hcuckoo_##K##_##V##_loc){&h->stash_hashes[s], &h->stash_keys[s], &h->stash_values[s]};\
+    }\
+    *loc.hash = hash;\
+    *loc.key = *key;\
+    return loc.value;\
+}\
+\
+/* rebuilds the table with at least twice the buckets, reusing the stored hashes; false if h is left unchanged as \
+ * it cannot get larger, or HCUCKOO_GROW_TRIES doublings could not place its keys */\
+static bool hcuckoo_##K##_##V##_grow(hcuckoo_##K##_##V *h)\
+{\
+    uint32_t buckets = h->cap / HCUCKOO_SLOTS;\
+    for (int tries = 0; tries < HCUCKOO_GROW_TRIES; tries++) {\
+        if (buckets > UINT32_MAX / HCUCKOO_SLOTS / 2)\
+            return false;\
+        buckets <<= 1;\
+        hcuckoo_##K##_##V new = *h;\
+        hcuckoo_##K##_##V##_alloc(&new, buckets);\
+        if (new.buckets == NULL)\
+            return false;\
+        bool ok = true;\
+        for (uint32_t i = 0; ok && i < h->cap / HCUCKOO_SLOTS; i++) {\
+            hcuckoo_##K##_##V##_bucket *b = &h->buckets[i];\
+            for (int s = 0; ok && s < HCUCKOO_SLOTS; s++) {\
+                if (b->hashes[s] == 0)\
+                    continue;\
+                V *value = hcuckoo_##K##_##V##_insert_new(&new, &b->keys[s], b->hashes[s]);\
+                if (value != NULL) *value = b->values[s];\
+                ok = value != NULL;\
+            }\
+        }\
+        for (uint32_t s = 0; ok && s < h->stash_len; s++) {\
+            V *value = hcuckoo_##K##_##V##_insert_new(&new, &h->stash_keys[s], h->stash_hashes[s]);\
+            if (value != NULL) *value = h->stash_values[s];\
+            ok = value != NULL;\
+        }\
+        if (!ok) {\
+            free(new.buckets);\
+            continue;\
+        }\
+        free(h->buckets);\
+        *h = new;\
+        return true;\
+    }\
+    return false;\
+}\
+\
+/* true if both buckets of hash are full of keys with that hash, which no table size separates */\
+static bool hcuckoo_##K##_##V##_saturated(const hcuckoo_##K##_##V *h, uint32_t hash)\
+{\
+    uint32_t i[2] = {hcuckoo_##K##_##V##_index1(h, hash), hcuckoo_##K##_##V##_index2(h, hash)};\
+    for (int n = 0; n < 2; n++) {\
+        for (int s = 0; s < HCUCKOO_SLOTS; s++) {\
+            if (h->buckets[i[n]].hashes[s] != hash)\
+                return false;\
+        }\
+    }\
+    return true;\
+}\
+\
+V *hcuckoo_##K##_##V##_put(hcuckoo_##K##_##V *h, const K *key)\
+{\
+    uint32_t hash = hcuckoo_##K##_##V##_hash(key);\
+    hcuckoo_##K##_##V##_loc loc = hcuckoo_##K##_##V##_find(h, key, hash);\
+    if (loc.value != NULL)\
+        return loc.value;\
+    if (h->len >= h->threshold)\
+        hcuckoo_##K##_##V##_grow(h);\
+    V *value;\
+    while ((value = hcuckoo_##K##_##V##_insert_new(h, key, hash)) == NULL) {\
+        /* below half the threshold a table is not full, its keys collide, and more buckets are unlikely to help */\
+        if (hcuckoo_##K##_##V##_saturated(h, hash) || h->len < h->threshold / 2 || !hcuckoo_##K##_##V##_grow(h))\
+            return NULL;\
+    }\
+    h->len++;\
+    return value;\
+}\
+\
+V *hcuckoo_##K##_##V##_get(const hcuckoo_##K##_##V *h, const K *key)\
+{\
+    return hcuckoo_##K##_##V##_find(h, key, hcuckoo_##K##_##V##_hash(key)).value;\
+}\
+\
+bool hcuckoo_##K##_##V##_remove(hcuckoo_##K##_##V *h, const K *key)\
+{\
+    hcuckoo_##K##_##V##_loc loc = hcuckoo_##K##_##V##_find(h, key, hcuckoo_##K##_##V##_hash(key));\
+    if (loc.value == NULL)\
+        return false;\
+    if (h->key_destructor != NULL) h->key_destructor(loc.key);\
+    if (h->value_destructor != NULL) h->value_destructor(loc.value);\
+    if (loc.hash >= h->stash_hashes && loc.hash < h->stash_hashes + HCUCKOO_STASH) {\
+        /* keep the stash dense */\
+        uint32_t s = loc.hash - h->stash_hashes;\
+        uint32_t last = --h->stash_len;\
+        h->stash_hashes[s] = h->stash_hashes[last];\
+        h->stash_keys[s] = h->stash_keys[last];\
+        h->stash_values[s] = h->stash_values[last];\
+    } else {\
+        *loc.hash = 0;\
+    }\
+    h->len--;\
+    return true;\
+}\
+\
+void hcuckoo_##K##_##V##_for_each(hcuckoo_##K##_##V *h, void (*fn)(const K *key, V *value, void *ctx), void *ctx)\
+{\
+    for (uint32_t i = 0; i < h->cap / HCUCKOO_SLOTS; i++) {\
+        hcuckoo_##K##_##V##_bucket *b = &h->buckets[i];\
+        for (int s = 0; s < HCUCKOO_SLOTS; s++) {\
+            if (b->hashes[s] != 0) fn(&b->keys[s], &b->values[s], ctx);\
+        }\
+    }\
+    for (uint32_t s = 0; s < h->stash_len; s++)\
+        fn(&h->stash_keys[s], &h->stash_values[s], ctx);\
+}\
+\
+static void hcuckoo_##K##_##V##_destroy_entry(const K *key, V *value, void *ctx)\
+{\
+    hcuckoo_##K##_##V *h = ctx;\
+    if (h->key_destructor != NULL) h->key_destructor((K *)key);\
+    if (h->value_destructor != NULL) h->value_destructor(value);\
+}\
+\
+void hcuckoo_##K##_##V##_destroy(hcuckoo_##K##_##V *h)\
+{\
+    if (h->key_destructor != NULL || h->value_destructor != NULL)\
+        hcuckoo_##K##_##V##_for_each(h, hcuckoo_##K##_##V##_destroy_entry, h);\
+    free(h->buckets);\
+}
@@ -0,0 +1,171 @@
+/*
+ * Implements a string interner.
+ * Every distinct string is copied once into a bump arena and gets a dense id, counting up from 0. The index is a
+ * hset of (string, id) pairs, so interning a string that is already present costs one probe and no allocation,
+ * and turning an id back into its string is an array access.
+ * Usage
+ * =====
+ * HINTERN_DEFINE
+ *     Defines the functions. Has to be used in exactly one translation unit.
+ *
+ * Functions
+ * =========
+ * void hintern_init(hintern *in):
+ *     Initiates the interner.
+ *
+ * uint32_t hintern_intern(hintern *in, const char *str, size_t len):
+ *     Returns the id of the len bytes at str, copying them into the arena if they were not interned yet.
+ *     str does not need to be NUL terminated. Returns HINTERN_NONE if len is above UINT32_MAX, as lengths are
+ *     stored in 32 bits.
+ *
+ * uint32_t hintern_find(const hintern *in, const char *str, size_t len):
+ *     Returns the id of the string, or HINTERN_NONE if it was never interned.
+ *
+ * hintern_str hintern_lookup(const hintern *in, uint32_t id):
+ *     Returns the interned string of the id. data is NUL terminated and stays valid until the interner is destroyed.
+ *
+ * void hintern_destroy(hintern *in):
+ *     Destroys the interner, freeing the arena and every string in it.
+ *
+ * Example
+ * =======
+ * HINTERN_DEFINE
+ *
+ * hintern in;
+ * hintern_init(&in);
+ * uint32_t a = hintern_intern(&in, "cpu.load", 8);
+ * uint32_t b = hintern_intern(&in, "cpu.load", 8);
+ * printf("%d", a == b); // 1
+ * printf("%s", hintern_lookup(&in, a).data); // cpu.load
+ * hintern_destroy(&in);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hset.h"
+#include "hmap_str.h"
+
+#define HINTERN_NONE       UINT32_MAX
+#define HINTERN_CHUNK_SIZE (64 * 1024)
+
+typedef struct hintern_str {
+    const char *data;
+    uint32_t   len;
+} hintern_str;
+
+typedef struct hintern_key {
+    const char *data;
+    uint32_t   len;
+    uint32_t   id;
+} hintern_key;
+
+static inline uint32_t hintern_key_hash(const hintern_key *key)
+{
+    return hmap_str_hash(key->data, key->len);
+}
+
+static inline bool hintern_key_eq(const hintern_key *a, const hintern_key *b)
+{
+    return a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+HSET_DECLARE(hintern_key)
+
+typedef struct hintern {
+    hset_hintern_key index;
+    hintern_str      *strings;
+    uint32_t         len;
+    uint32_t         cap;
+    /* chunks are linked through their first bytes, newest first */
+    char             *chunk;
+    size_t           chunk_used;
+    size_t           chunk_cap;
+} hintern;
+
+void     hintern_init(hintern *in);
+uint32_t hintern_intern(hintern *in, const char *str, size_t len);
+uint32_t hintern_find(const hintern *in, const char *str, size_t len);
+void     hintern_destroy(hintern *in);
+
+static inline hintern_str hintern_lookup(const hintern *in, uint32_t id)
+{
+    return in->strings[id];
+}
+
+#define HINTERN_DEFINE \
+HSET_DEFINE(hintern_key, hintern_key_hash, hintern_key_eq)\
+\
+void hintern_init(hintern *in)\
+{\
+    hset_hintern_key_init(&in->index, NULL);\
+    in->len = 0;\
+    in->cap = 16;\
+    in->strings = malloc(in->cap * sizeof(*in->strings));\
+    in->chunk = NULL;\
+    in->chunk_used = 0;\
+    in->chunk_cap = 0;\
+}\
+\
+static char *hintern_copy(hintern *in, const char *str, size_t len)\
+{\
+    if (in->chunk_cap - in->chunk_used < len + 1) {\
+        size_t cap = sizeof(char *) + len + 1;\
+        if (cap < HINTERN_CHUNK_SIZE)\
+            cap = HINTERN_CHUNK_SIZE;\
+        char *chunk = malloc(cap);\
+        memcpy(chunk, &in->chunk, sizeof(char *));\
+        in->chunk = chunk;\
+        in->chunk_used = sizeof(char *);\
+        in->chunk_cap = cap;\
+    }\
+    char *copy = in->chunk + in->chunk_used;\
+    memcpy(copy, str, len);\
+    copy[len] = '\0';\
+    in->chunk_used += len + 1;\
+    return copy;\
+}\
+\
+uint32_t hintern_intern(hintern *in, const char *str, size_t len)\
+{\
+    if (len > UINT32_MAX)\
+        return HINTERN_NONE;\
+    hintern_key probe = {str, len, in->len};\
+    hintern_key *key = hset_hintern_key_put(&in->index, &probe);\
+    if (key->id != in->len)\
+        return key->id;\
+    /* newly added: the stored key still points at the caller's bytes */\
+    key->data = hintern_copy(in, str, len);\
+    if (in->len == in->cap) {\
+        in->cap <<= 1;\
+        in->strings = realloc(in->strings, in->cap * sizeof(*in->strings));\
+    }\
+    in->strings[in->len] = (hintern_str){key->data, key->len};\
+    return in->len++;\
+}\
+\
+uint32_t hintern_find(const hintern *in, const char *str, size_t len)\
+{\
+    if (len > UINT32_MAX)\
+        return HINTERN_NONE;\
+    hintern_key probe = {str, len, HINTERN_NONE};\
+    hintern_key *key = hset_hintern_key_get(&in->index, &probe);\
+    return key != NULL ? key->id : HINTERN_NONE;\
+}\
+\
+void hintern_destroy(hintern *in)\
+{\
+    hset_hintern_key_destroy(&in->index);\
+    free(in->strings);\
+    while (in->chunk != NULL) {\
+        char *prev;\
+        memcpy(&prev, in->chunk, sizeof(char *));\
+        free(in->chunk);\
+        in->chunk = prev;\
+    }\
+}
@@ -1,17 +1,30 @@
 /*
  * Implements a generic hashmap.
+ * The bucket array is allocated by the first put, so empty maps allocate nothing. Maps declared with
+ * HMAP_DECLARE_SMALL also store their first HMAP_INLINE_CAPACITY entries inside hmap_K_V, looked up by a linear scan,
+ * and allocate the bucket array once they are full, so tiny maps allocate nothing either.
+ * Bucket arrays come zeroed from calloc, or on Linux from mmap with MADV_HUGEPAGE once they reach HMAP_MMAP_THRESHOLD
+ * bytes, so large tables take fewer TLB misses. With _GNU_SOURCE defined, such arrays grow by mremap, which moves
+ * pages instead of copying them, and every chain is split in place.
  * Usage
  * =====
  * HMAP_DECLARE(K, V) 
  *     Defines structures hmap_K_V and hmap_K_V_entry, and declares the functions.
  *     If K or V is a pointer, then it has to be typedef'd.
+ * HMAP_DECLARE_SMALL(K, V)
+ *     As HMAP_DECLARE, for a map storing its first entries inline. Inline entries move when the map is modified, so
+ *     pointers to its entries and values are only valid until the next put or remove, extract returns a malloc'd
+ *     copy of an inline entry, and put_entry frees the entry it is given while the map is inline.
+ *     HMAP_INLINE_CAPACITY, at least 1, can be defined before including hmap.h; it must be the same everywhere.
  * HMAP_DEFINE(K, V, hash_func, eq_func) 
- *     Defines the functions. 
+ *     Defines the functions, for either declaration. 
  *     hash_func: Must have signature: uint32_t hash_func(const K *)
  *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
  * HMAP_ITER_BEGIN(h, element_name) 
  *     Starts a for loop where element_name is a pointer to hmap_K_V_entry which can be used as iterator value.
  *     Modifying the hashmap or entry except for the value is forbidden.
+ * HMAP_SMALL_ITER_BEGIN(h, element_name)
+ *     As HMAP_ITER_BEGIN, for maps declared with HMAP_DECLARE_SMALL.
  * HMAP_ITER_END
  *     Ends the for loop 
  * There should not be any semicolon after the macros.
@@ -19,7 +32,9 @@
  * Functions
  * =========
  * void hmap_K_V_init_custom(hmap_K_V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value)): 
- *     Initiates the hashmap with given parameters. initial capacity is rounded to next power of 2. 
+ *     Initiates the hashmap with given parameters. initial capacity is rounded to next power of 2, and is the
+ *     capacity the bucket array is allocated with by the first put, or once the inline entries are full.
+ *     Allocates nothing.
  *     Destructors can be NULL in which case they are ignored.
  *
  * void hmap_K_V_init(hmap_K_V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value)): 
@@ -34,6 +49,10 @@
  * V *hmap_K_V_get(const hmap_K_V *h, const K *key): 
  *     Gets a pointer to the value associated with the key; returns NULL if it doesn't exist.
  *
+ * V *hmap_K_V_get_with(const hmap_K_V *h, const void *probe, uint32_t hash, bool (*eq_probe)(const K *key, const void *probe)):
+ *     As get, for a key described by probe, such as a string slice, so no K has to be built to look it up.
+ *     hash must be what hash_func returns for the equal key; eq_probe tells whether a key equals probe.
+ *
  * hmap_K_V_entry *hmap_K_V_extract(hmap_K_V *h, const K *key): 
  *     Removes and returns the entry associated with the key; returns NULL if it doesn't exist.
  *     The entry has to be `free`d yourself. Destroying the key and value also is now your responsibility.
@@ -43,6 +62,35 @@
  *     Removes the entry associated with the key from the map, freeing it and calling destructors for key and value.
  *     Returns true if removed, false if it doesn't exist.
  *
+ * void hmap_K_V_clone(hmap_K_V *dst, const hmap_K_V *src, void (*key_copy)(K *dst, const K *src), void (*value_copy)(V *dst, const V *src)):
+ *     Initiates dst as a copy of src, with the same parameters and destructors. Keys and values are copied with
+ *     key_copy and value_copy, or bitwise if they are NULL. The stored hashes are reused, so hash_func is not called.
+ *
+ * void hmap_K_V_merge(hmap_K_V *dst, hmap_K_V *src, void (*on_conflict)(V *dst_value, V *src_value, void *ctx), void *ctx):
+ *     Moves every entry of src into dst, leaving src empty. Entries are relinked using their stored hash, so neither
+ *     hash_func nor malloc is called. When dst already has the key, on_conflict combines src_value into dst_value,
+ *     and the key and value of src are then destroyed with the destructors of src; if on_conflict is NULL, the src
+ *     entry replaces the dst one as with put_entry. With HMAP_DECLARE_SMALL, inline entries moving to buckets are
+ *     copied into malloc'd ones.
+ *
+ * void hmap_K_V_split(hmap_K_V *src, hmap_K_V *out[], uint32_t n):
+ *     Moves the entries of src into the n maps of out, leaving src empty. n must be a power of 2. The maps of out are
+ *     initiated by split with the parameters and destructors of src, and presized for their share. An entry goes to
+ *     the map picked by the top bits of its stored hash times a fibonacci constant and is relinked, so neither
+ *     hash_func nor malloc is called. With HMAP_DECLARE_SMALL, inline entries of src are copied into malloc'd ones
+ *     when they go to buckets.
+ *
+ * uint32_t hmap_K_V_retain(hmap_K_V *h, bool (*pred)(hmap_K_V_entry *e, void *ctx), void *ctx):
+ *     Keeps only the entries for which pred returns true, removing the others like remove does, in a single pass
+ *     over the buckets. pred may modify the value, but not the key or the map. Returns the number of removed entries.
+ *
+ * uint32_t hmap_K_V_scan(hmap_K_V *h, uint32_t cursor, void (*fn)(hmap_K_V_entry *e, void *ctx), void *ctx, uint32_t max_buckets):
+ *     Calls fn on the entries of up to max_buckets buckets starting at cursor, and returns the cursor to continue from.
+ *     Start with cursor 0; the scan is complete when 0 is returned. The cursor walks bucket indices in reverse
+ *     binary order, so every entry present for the whole scan is visited at least once even if the map is resized
+ *     in between; entries may be visited more than once. fn must not modify the map, but the map can be freely
+ *     modified between calls.
+ *
  * void hmap_K_V_destroy(hmap_K_V *h): 
  *     Destroys the map by freeing memory, and calling destructors of keys and values.
  * 
@@ -67,13 +115,23 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #define HMAP_DEFAULT_LOAD_FACTOR      0.75
 #define HMAP_DEFAULT_INITIAL_CAPACITY 16
+#ifndef HMAP_INLINE_CAPACITY
+#define HMAP_INLINE_CAPACITY          4
+#endif
+#ifndef HMAP_MMAP_THRESHOLD
+#define HMAP_MMAP_THRESHOLD           (2u << 20)
+#endif
 
-#define HMAP_DECLARE(K, V) \
+#define HMAP_DECLARE_COMMON(K, V, small_field) \
 typedef struct hmap_##K##_##V##_entry hmap_##K##_##V##_entry;\
 typedef struct hmap_##K##_##V##_entry {\
     uint32_t               hash;\
@@ -89,7 +147,9 @@ typedef struct hmap_##K##_##V {\
     uint32_t               threshold;\
     void                   (*key_destructor)(K *key);\
     void                   (*value_destructor)(V *value);\
+    /* NULL until the first put, or while the entries fit in small */\
     hmap_##K##_##V##_entry **buckets;\
+    small_field\
 } hmap_##K##_##V;\
 \
 void                    hmap_##K##_##V##_init_custom(hmap_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value));\
@@ -97,15 +157,115 @@ void                    hmap_##K##_##V##_init(hmap_##K##_##V *h, void (*key_dest
 V                      *hmap_##K##_##V##_put(hmap_##K##_##V *h, const K *key);\
 void                    hmap_##K##_##V##_put_entry(hmap_##K##_##V *h, hmap_##K##_##V##_entry *entry);\
 V                      *hmap_##K##_##V##_get(const hmap_##K##_##V *h, const K *key);\
+V                      *hmap_##K##_##V##_get_with(const hmap_##K##_##V *h, const void *probe, uint32_t hash, bool (*eq_probe)(const K *key, const void *probe));\
 hmap_##K##_##V##_entry *hmap_##K##_##V##_extract(hmap_##K##_##V *h, const K *key);\
 bool                    hmap_##K##_##V##_remove(hmap_##K##_##V *h, const K *key);\
+void                    hmap_##K##_##V##_clone(hmap_##K##_##V *dst, const hmap_##K##_##V *src, void (*key_copy)(K *dst, const K *src), void (*value_copy)(V *dst, const V *src));\
+void                    hmap_##K##_##V##_merge(hmap_##K##_##V *dst, hmap_##K##_##V *src, void (*on_conflict)(V *dst_value, V *src_value, void *ctx), void *ctx);\
+void                    hmap_##K##_##V##_split(hmap_##K##_##V *src, hmap_##K##_##V *out[], uint32_t n);\
+uint32_t                hmap_##K##_##V##_retain(hmap_##K##_##V *h, bool (*pred)(hmap_##K##_##V##_entry *e, void *ctx), void *ctx);\
+uint32_t                hmap_##K##_##V##_scan(hmap_##K##_##V *h, uint32_t cursor, void (*fn)(hmap_##K##_##V##_entry *e, void *ctx), void *ctx, uint32_t max_buckets);\
 void                    hmap_##K##_##V##_destroy(hmap_##K##_##V *h);
 
+/* the inline entries are reached through these, so HMAP_DEFINE serves both declarations */
+#define HMAP_DECLARE(K, V) \
+HMAP_DECLARE_COMMON(K, V, )\
+\
+static inline uint32_t hmap_##K##_##V##_inline_capacity(void)\
+{\
+    return 0;\
+}\
+\
+static inline hmap_##K##_##V##_entry *hmap_##K##_##V##_small(const hmap_##K##_##V *h)\
+{\
+    (void)h;\
+    return NULL;\
+}
+
+#define HMAP_DECLARE_SMALL(K, V) \
+HMAP_DECLARE_COMMON(K, V, hmap_##K##_##V##_entry small[HMAP_INLINE_CAPACITY];)\
+\
+static inline uint32_t hmap_##K##_##V##_inline_capacity(void)\
+{\
+    return HMAP_INLINE_CAPACITY;\
+}\
+\
+static inline hmap_##K##_##V##_entry *hmap_##K##_##V##_small(const hmap_##K##_##V *h)\
+{\
+    return (hmap_##K##_##V##_entry *)h->small;\
+}
+
+/* applied by every map here to what hash_func returns */
+static inline uint32_t hmap_mix(uint32_t h)
+{
+    /* magic from jdk 7 hashmap. mitigates problems with power of 2 hashmap size*/
+    h ^= (h >> 20) ^ (h >> 12);
+    return h ^ (h >> 7) ^ (h >> 4);
+}
+
+static inline uint32_t hmap_reverse_bits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+    v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+    v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+/* returns size zeroed bytes for a bucket array; large ones are fresh pages, so nothing is written to zero them */
+static inline void *hmap_buckets_alloc(size_t size)
+{
+#ifdef MAP_ANONYMOUS
+    if (size >= HMAP_MMAP_THRESHOLD) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+        return p;
+    }
+#endif
+    return calloc(1, size);
+}
+
+static inline void hmap_buckets_free(void *p, size_t size)
+{
+#ifdef MAP_ANONYMOUS
+    if (size >= HMAP_MMAP_THRESHOLD) {
+        if (p != NULL)
+            munmap(p, size);
+        return;
+    }
+#endif
+    free(p);
+}
+
+/* grows a bucket array from hmap_buckets_alloc keeping its contents, the rest zeroed; NULL if it has to be copied */
+static inline void *hmap_buckets_grow(void *p, size_t old_size, size_t size)
+{
+#ifdef MREMAP_MAYMOVE
+    if (old_size >= HMAP_MMAP_THRESHOLD) {
+        void *q = mremap(p, old_size, size, MREMAP_MAYMOVE);
+        if (q != MAP_FAILED)
+            return q;
+    }
+#else
+    (void)p, (void)old_size, (void)size;
+#endif
+    return NULL;
+}
+
 #define HMAP_ITER_BEGIN(h, element_name) \
-for (uint32_t element_name##i = 0; element_name##i < (h)->cap; element_name##i++) {\
+for (uint32_t element_name##i = 0; element_name##i < ((h)->buckets != NULL ? (h)->cap : 0); element_name##i++) {\
     typeof((h)->buckets[element_name##i]) element_name = (h)->buckets[element_name##i];\
     for (; element_name != NULL; element_name = element_name->next) {
 
+#define HMAP_SMALL_ITER_BEGIN(h, element_name) \
+for (uint32_t element_name##i = 0; element_name##i < ((h)->buckets != NULL ? (h)->cap : (h)->len); element_name##i++) {\
+    typeof((h)->buckets[0]) element_name = (h)->buckets != NULL ? (h)->buckets[element_name##i] : (typeof((h)->buckets[0]))&(h)->small[element_name##i];\
+    for (; element_name != NULL; element_name = element_name->next) {
+
 #define HMAP_ITER_END \
     }\
 }
@@ -119,13 +279,11 @@ void hmap_##K##_##V##_init_custom(hmap_##K##_##V *h, float load_factor, uint32_t
         cap <<= 1;\
     h->cap = cap;\
     h->load_factor = load_factor;\
-    h->threshold = load_factor * h->cap;\
+    /* until the bucket array is allocated, the threshold is when the inline entries, if any, are full */\
+    h->threshold = hmap_##K##_##V##_inline_capacity();\
     h->key_destructor = key_destructor;\
     h->value_destructor = value_destructor;\
-    h->buckets = malloc(h->cap * sizeof(*h->buckets));\
-    for (uint32_t i = 0; i < h->cap; i++) {\
-        h->buckets[i] = NULL;\
-    }\
+    h->buckets = NULL;\
 }\
 \
 void hmap_##K##_##V##_init(hmap_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value))\
@@ -135,23 +293,54 @@ void hmap_##K##_##V##_init(hmap_##K##_##V *h, void (*key_destructor)(K *key), vo
 \
 static uint32_t hmap_##K##_##V##_hash(const K *key) \
 {\
-    /* magic from jdk 7 hashmap. mitigates problems with power of 2 hashmap size*/\
-    uint32_t h = hash_func(key);\
-    h ^= (h >> 20) ^ (h >> 12);\
-    return h ^ (h >> 7) ^ (h >> 4);\
+    return hmap_mix(hash_func(key));\
 }\
 \
 static void hmap_##K##_##V##_resize(hmap_##K##_##V *h) \
 {\
     hmap_##K##_##V new = *h;\
-    new.cap <<= 1;\
+    if (h->buckets != NULL)\
+        new.cap <<= 1;\
+    /* the inline entries go to a bucket array of the initial capacity, unless it is too small for them */\
+    while (new.len >= new.load_factor * new.cap)\
+        new.cap <<= 1;\
     new.threshold = new.load_factor * new.cap;\
-    new.buckets = malloc(new.cap * sizeof(*new.buckets));\
-    for (uint32_t i = 0; i < new.cap; i++) {\
-        new.buckets[i] = NULL;\
+    hmap_##K##_##V##_entry **grown = NULL;\
+    if (h->buckets != NULL && new.cap == h->cap << 1) {\
+        grown = hmap_buckets_grow(h->buckets, h->cap * sizeof(*h->buckets), new.cap * sizeof(*new.buckets));\
+    }\
+    if (grown != NULL) {\
+        /* grown in place: the upper half is zeroed, so chain i only splits between i and i + cap */\
+        new.buckets = grown;\
+        for (uint32_t i = 0; i < h->cap; i++) {\
+            hmap_##K##_##V##_entry **lo = &new.buckets[i];\
+            hmap_##K##_##V##_entry **hi = &new.buckets[i + h->cap];\
+            for (hmap_##K##_##V##_entry *e = *lo; e != NULL; e = e->next) {\
+                if (e->hash & h->cap) {\
+                    *hi = e;\
+                    hi = &e->next;\
+                } else {\
+                    *lo = e;\
+                    lo = &e->next;\
+                }\
+            }\
+            *lo = NULL;\
+            *hi = NULL;\
+        }\
+        *h = new;\
+        return;\
     }\
+    new.buckets = hmap_buckets_alloc(new.cap * sizeof(*new.buckets));\
 \
-    for (uint32_t i = 0; i < h->cap; i++) {\
+    if (h->buckets == NULL) {\
+        for (uint32_t i = 0; i < h->len; i++) {\
+            hmap_##K##_##V##_entry *e = malloc(sizeof(*e));\
+            *e = hmap_##K##_##V##_small(h)[i];\
+            e->next = new.buckets[e->hash & (new.cap - 1)];\
+            new.buckets[e->hash & (new.cap - 1)] = e;\
+        }\
+    }\
+    for (uint32_t i = 0; h->buckets != NULL && i < h->cap; i++) {\
         hmap_##K##_##V##_entry *e = (h)->buckets[i];\
         while(e != NULL) {\
             hmap_##K##_##V##_entry *next = e->next;\
@@ -161,7 +350,7 @@ static void hmap_##K##_##V##_resize(hmap_##K##_##V *h) \
             e = next;\
         }\
     }\
-    free(h->buckets);\
+    hmap_buckets_free(h->buckets, h->cap * sizeof(*h->buckets));\
     *h = new;\
 }\
 \
@@ -172,10 +361,61 @@ static void hmap_##K##_##V##_resize_if_required(hmap_##K##_##V *h)\
     }\
 }\
 \
-V * hmap_##K##_##V##_put(hmap_##K##_##V *h, const K *key)\
+static hmap_##K##_##V##_entry *hmap_##K##_##V##_find(const hmap_##K##_##V *h, uint32_t hash, const K *key)\
+{\
+    if (h->buckets == NULL) {\
+        hmap_##K##_##V##_entry *small = hmap_##K##_##V##_small(h);\
+        for (uint32_t i = 0; i < h->len; i++) {\
+            if (small[i].hash == hash && eq_func(&small[i].key, key)) {\
+                return &small[i];\
+            }\
+        }\
+        return NULL;\
+    }\
+    hmap_##K##_##V##_entry *e = h->buckets[hash & (h->cap - 1)];\
+    for (; e != NULL; e = e->next) {\
+        if (e->hash == hash && eq_func(&e->key, key)) {\
+            return e;\
+        }\
+    }\
+    return NULL;\
+}\
+\
+/* adds e, whose key is absent. if owned, e was malloc'd and is taken over, otherwise it is copied */\
+static void hmap_##K##_##V##_push(hmap_##K##_##V *h, hmap_##K##_##V##_entry *e, bool owned)\
 {\
+    if (h->buckets == NULL && h->len < hmap_##K##_##V##_inline_capacity()) {\
+        hmap_##K##_##V##_small(h)[h->len] = *e;\
+        hmap_##K##_##V##_small(h)[h->len++].next = NULL;\
+        if (owned) free(e);\
+        return;\
+    }\
     hmap_##K##_##V##_resize_if_required(h);\
+    if (!owned) {\
+        hmap_##K##_##V##_entry *copy = malloc(sizeof(*copy));\
+        *copy = *e;\
+        e = copy;\
+    }\
+    e->next = h->buckets[e->hash & (h->cap - 1)];\
+    h->buckets[e->hash & (h->cap - 1)] = e;\
+    h->len++;\
+}\
+\
+V * hmap_##K##_##V##_put(hmap_##K##_##V *h, const K *key)\
+{\
     uint32_t hash = hmap_##K##_##V##_hash(key);\
+    if (h->buckets == NULL) {\
+        hmap_##K##_##V##_entry *e = hmap_##K##_##V##_find(h, hash, key);\
+        if (e == NULL && h->len < hmap_##K##_##V##_inline_capacity()) {\
+            e = &hmap_##K##_##V##_small(h)[h->len++];\
+            e->hash = hash;\
+            e->key = *key;\
+            e->next = NULL;\
+        }\
+        if (e != NULL)\
+            return &e->value;\
+    }\
+    hmap_##K##_##V##_resize_if_required(h);\
     uint32_t index = hash & (h->cap - 1);\
     hmap_##K##_##V##_entry **e = &h->buckets[index];\
     for (; *e != NULL; e = &(*e)->next) {\
@@ -194,8 +434,22 @@ V * hmap_##K##_##V##_put(hmap_##K##_##V *h, const K *key)\
 \
 void hmap_##K##_##V##_put_entry(hmap_##K##_##V *h, hmap_##K##_##V##_entry *entry)\
 {\
-    hmap_##K##_##V##_resize_if_required(h);\
     uint32_t hash = hmap_##K##_##V##_hash(&entry->key);\
+    if (h->buckets == NULL) {\
+        entry->hash = hash;\
+        hmap_##K##_##V##_entry *e = hmap_##K##_##V##_find(h, hash, &entry->key);\
+        if (e == NULL) {\
+            hmap_##K##_##V##_push(h, entry, true);\
+            return;\
+        }\
+        if (h->key_destructor != NULL) h->key_destructor(&e->key);\
+        if (h->value_destructor != NULL) h->value_destructor(&e->value);\
+        *e = *entry;\
+        e->next = NULL;\
+        free(entry);\
+        return;\
+    }\
+    hmap_##K##_##V##_resize_if_required(h);\
     uint32_t index = hash & (h->cap - 1);\
     hmap_##K##_##V##_entry *e = h->buckets[index];\
 	hmap_##K##_##V##_entry **prev_next = &h->buckets[index];\
@@ -221,11 +475,25 @@ void hmap_##K##_##V##_put_entry(hmap_##K##_##V *h, hmap_##K##_##V##_entry *entry
 \
 V *hmap_##K##_##V##_get(const hmap_##K##_##V *h, const K *key)\
 {\
-    uint32_t hash = hmap_##K##_##V##_hash(key);\
-    uint32_t index = hash & (h->cap - 1);\
-    hmap_##K##_##V##_entry *e = h->buckets[index];\
+    hmap_##K##_##V##_entry *e = hmap_##K##_##V##_find(h, hmap_##K##_##V##_hash(key), key);\
+    return e != NULL ? &e->value : NULL;\
+}\
+\
+V *hmap_##K##_##V##_get_with(const hmap_##K##_##V *h, const void *probe, uint32_t hash, bool (*eq_probe)(const K *key, const void *probe))\
+{\
+    hash = hmap_mix(hash);\
+    if (h->buckets == NULL) {\
+        hmap_##K##_##V##_entry *small = hmap_##K##_##V##_small(h);\
+        for (uint32_t i = 0; i < h->len; i++) {\
+            if (small[i].hash == hash && eq_probe(&small[i].key, probe)) {\
+                return &small[i].value;\
+            }\
+        }\
+        return NULL;\
+    }\
+    hmap_##K##_##V##_entry *e = h->buckets[hash & (h->cap - 1)];\
     for (; e != NULL; e = e->next) {\
-        if (e->hash == hash && eq_func(&e->key, key)) {\
+        if (e->hash == hash && eq_probe(&e->key, probe)) {\
             return &e->value;\
         }\
     }\
@@ -235,6 +503,15 @@ V *hmap_##K##_##V##_get(const hmap_##K##_##V *h, const K *key)\
 hmap_##K##_##V##_entry *hmap_##K##_##V##_extract(hmap_##K##_##V *h, const K *key)\
 {\
     uint32_t hash = hmap_##K##_##V##_hash(key);\
+    if (h->buckets == NULL) {\
+        hmap_##K##_##V##_entry *e = hmap_##K##_##V##_find(h, hash, key);\
+        if (e == NULL)\
+            return NULL;\
+        hmap_##K##_##V##_entry *copy = malloc(sizeof(*copy));\
+        *copy = *e;\
+        *e = hmap_##K##_##V##_small(h)[--h->len];\
+        return copy;\
+    }\
     uint32_t index = hash & (h->cap - 1);\
     hmap_##K##_##V##_entry *e = h->buckets[index];\
     hmap_##K##_##V##_entry **prev_next = &h->buckets[index];\
@@ -248,20 +525,209 @@ hmap_##K##_##V##_entry *hmap_##K##_##V##_extract(hmap_##K##_##V *h, const K *key
     return NULL;\
 }\
 \
+/* removes and destroys the entry of key, given its hash */\
+static bool hmap_##K##_##V##_drop(hmap_##K##_##V *h, uint32_t hash, const K *key)\
+{\
+    hmap_##K##_##V##_entry **prev_next = NULL;\
+    hmap_##K##_##V##_entry *e = NULL;\
+    if (h->buckets == NULL) {\
+        e = hmap_##K##_##V##_find(h, hash, key);\
+    } else {\
+        prev_next = &h->buckets[hash & (h->cap - 1)];\
+        for (; *prev_next != NULL; prev_next = &(*prev_next)->next) {\
+            if ((*prev_next)->hash == hash && eq_func(&(*prev_next)->key, key)) {\
+                e = *prev_next;\
+                break;\
+            }\
+        }\
+    }\
+    if (e == NULL)\
+        return false;\
+    if (h->key_destructor != NULL) h->key_destructor(&e->key);\
+    if (h->value_destructor != NULL) h->value_destructor(&e->value);\
+    if (prev_next == NULL) {\
+        *e = hmap_##K##_##V##_small(h)[h->len - 1];\
+    } else {\
+        *prev_next = e->next;\
+        free(e);\
+    }\
+    h->len--;\
+    return true;\
+}\
+\
 bool hmap_##K##_##V##_remove(hmap_##K##_##V *h, const K *key)\
 {\
-    hmap_##K##_##V##_entry *entry = hmap_##K##_##V##_extract(h, key);\
-    if (entry) {\
-        if (h->key_destructor != NULL) h->key_destructor(&entry->key);\
-        if (h->value_destructor != NULL) h->value_destructor(&entry->value);\
-        free(entry);\
+    return hmap_##K##_##V##_drop(h, hmap_##K##_##V##_hash(key), key);\
+}\
+\
+void hmap_##K##_##V##_clone(hmap_##K##_##V *dst, const hmap_##K##_##V *src, void (*key_copy)(K *dst, const K *src), void (*value_copy)(V *dst, const V *src))\
+{\
+    *dst = *src;\
+    if (src->buckets == NULL) {\
+        for (uint32_t i = 0; i < src->len; i++) {\
+            hmap_##K##_##V##_entry *copy = &hmap_##K##_##V##_small(dst)[i];\
+            if (key_copy != NULL) key_copy(&copy->key, &hmap_##K##_##V##_small(src)[i].key);\
+            if (value_copy != NULL) value_copy(&copy->value, &hmap_##K##_##V##_small(src)[i].value);\
+        }\
+        return;\
+    }\
+    dst->buckets = hmap_buckets_alloc(dst->cap * sizeof(*dst->buckets));\
+    for (uint32_t i = 0; i < src->cap; i++) {\
+        hmap_##K##_##V##_entry **tail = &dst->buckets[i];\
+        for (hmap_##K##_##V##_entry *e = src->buckets[i]; e != NULL; e = e->next) {\
+            hmap_##K##_##V##_entry *copy = malloc(sizeof(*copy));\
+            *copy = *e;\
+            if (key_copy != NULL) key_copy(&copy->key, &e->key);\
+            if (value_copy != NULL) value_copy(&copy->value, &e->value);\
+            *tail = copy;\
+            tail = &copy->next;\
+        }\
+        *tail = NULL;\
     }\
-    return entry != NULL;\
 }\
 \
-void hmap_##K##_##V##_destroy(hmap_##K##_##V *h)\
+/* moves e from src into dst; owned as for push */\
+static void hmap_##K##_##V##_merge_entry(hmap_##K##_##V *dst, hmap_##K##_##V *src, hmap_##K##_##V##_entry *e, bool owned, void (*on_conflict)(V *dst_value, V *src_value, void *ctx), void *ctx)\
+{\
+    hmap_##K##_##V##_entry *old = hmap_##K##_##V##_find(dst, e->hash, &e->key);\
+    if (old == NULL) {\
+        hmap_##K##_##V##_push(dst, e, owned);\
+        return;\
+    }\
+    if (on_conflict != NULL) {\
+        on_conflict(&old->value, &e->value, ctx);\
+        if (src->key_destructor != NULL) src->key_destructor(&e->key);\
+        if (src->value_destructor != NULL) src->value_destructor(&e->value);\
+    } else {\
+        if (dst->key_destructor != NULL) dst->key_destructor(&old->key);\
+        if (dst->value_destructor != NULL) dst->value_destructor(&old->value);\
+        old->key = e->key;\
+        old->value = e->value;\
+    }\
+    if (owned) free(e);\
+}\
+\
+void hmap_##K##_##V##_merge(hmap_##K##_##V *dst, hmap_##K##_##V *src, void (*on_conflict)(V *dst_value, V *src_value, void *ctx), void *ctx)\
+{\
+    /* dst gets its buckets first unless everything fits inline, so the entries of src are relinked, not copied */\
+    if (dst->buckets != NULL || dst->len + src->len > hmap_##K##_##V##_inline_capacity()) {\
+        while (dst->len + src->len >= dst->threshold) {\
+            hmap_##K##_##V##_resize(dst);\
+        }\
+    }\
+    if (src->buckets == NULL) {\
+        for (uint32_t i = 0; i < src->len; i++) {\
+            hmap_##K##_##V##_merge_entry(dst, src, &hmap_##K##_##V##_small(src)[i], false, on_conflict, ctx);\
+        }\
+    }\
+    for (uint32_t i = 0; src->buckets != NULL && i < src->cap; i++) {\
+        hmap_##K##_##V##_entry *e = src->buckets[i];\
+        src->buckets[i] = NULL;\
+        while (e != NULL) {\
+            hmap_##K##_##V##_entry *next = e->next;\
+            hmap_##K##_##V##_merge_entry(dst, src, e, true, on_conflict, ctx);\
+            e = next;\
+        }\
+    }\
+    src->len = 0;\
+}\
+\
+void hmap_##K##_##V##_split(hmap_##K##_##V *src, hmap_##K##_##V *out[], uint32_t n)\
+{\
+    /* bucket indices use the low bits of the hash, so shards use the top ones, after a fibonacci multiply as the\
+     * mixed hash of small keys has them zero */\
+    uint32_t shift = 32;\
+    for (uint32_t i = n; i > 1; i >>= 1)\
+        shift--;\
+    for (uint32_t i = 0; i < n; i++) {\
+        hmap_##K##_##V##_init_custom(out[i], src->load_factor, src->cap / n, src->key_destructor, src->value_destructor);\
+        /* entries already in buckets are relinked into buckets, rather than copied inline and back */\
+        if (src->buckets != NULL)\
+            hmap_##K##_##V##_resize(out[i]);\
+    }\
+    if (src->buckets == NULL) {\
+        for (uint32_t i = 0; i < src->len; i++) {\
+            hmap_##K##_##V##_entry *e = &hmap_##K##_##V##_small(src)[i];\
+            hmap_##K##_##V##_push(out[shift < 32 ? (e->hash * 0x9e3779b9u) >> shift : 0], e, false);\
+        }\
+    }\
+    for (uint32_t i = 0; src->buckets != NULL && i < src->cap; i++) {\
+        hmap_##K##_##V##_entry *e = src->buckets[i];\
+        src->buckets[i] = NULL;\
+        while (e != NULL) {\
+            hmap_##K##_##V##_entry *next = e->next;\
+            hmap_##K##_##V##_push(out[shift < 32 ? (e->hash * 0x9e3779b9u) >> shift : 0], e, true);\
+            e = next;\
+        }\
+    }\
+    src->len = 0;\
+}\
+\
+uint32_t hmap_##K##_##V##_retain(hmap_##K##_##V *h, bool (*pred)(hmap_##K##_##V##_entry *e, void *ctx), void *ctx)\
 {\
+    uint32_t removed = 0;\
+    for (uint32_t i = 0; h->buckets == NULL && i < h->len;) {\
+        hmap_##K##_##V##_entry *e = &hmap_##K##_##V##_small(h)[i];\
+        if (pred(e, ctx)) {\
+            i++;\
+            continue;\
+        }\
+        if (h->key_destructor != NULL) h->key_destructor(&e->key);\
+        if (h->value_destructor != NULL) h->value_destructor(&e->value);\
+        *e = hmap_##K##_##V##_small(h)[--h->len];\
+        removed++;\
+    }\
+    if (h->buckets == NULL)\
+        return removed;\
     for (uint32_t i = 0; i < h->cap; i++) {\
+        hmap_##K##_##V##_entry **prev_next = &h->buckets[i];\
+        while (*prev_next != NULL) {\
+            hmap_##K##_##V##_entry *e = *prev_next;\
+            if (pred(e, ctx)) {\
+                prev_next = &e->next;\
+                continue;\
+            }\
+            *prev_next = e->next;\
+            if (h->key_destructor != NULL) h->key_destructor(&e->key);\
+            if (h->value_destructor != NULL) h->value_destructor(&e->value);\
+            free(e);\
+            removed++;\
+        }\
+    }\
+    h->len -= removed;\
+    return removed;\
+}\
+\
+uint32_t hmap_##K##_##V##_scan(hmap_##K##_##V *h, uint32_t cursor, void (*fn)(hmap_##K##_##V##_entry *e, void *ctx), void *ctx, uint32_t max_buckets)\
+{\
+    if (max_buckets == 0)\
+        return cursor;\
+    /* inline entries are a single bucket */\
+    if (h->buckets == NULL) {\
+        for (uint32_t i = 0; i < h->len; i++) {\
+            fn(&hmap_##K##_##V##_small(h)[i], ctx);\
+        }\
+        return 0;\
+    }\
+    uint32_t mask = h->cap - 1;\
+    do {\
+        for (hmap_##K##_##V##_entry *e = h->buckets[cursor & mask]; e != NULL; e = e->next) {\
+            fn(e, ctx);\
+        }\
+        /* increment the reversed cursor: buckets a visited one splits into on resize come after it */\
+        cursor |= ~mask;\
+        cursor = hmap_reverse_bits(hmap_reverse_bits(cursor) + 1);\
+    } while (cursor != 0 && --max_buckets > 0);\
+    return cursor;\
+}\
+\
+void hmap_##K##_##V##_destroy(hmap_##K##_##V *h)\
+{\
+    for (uint32_t i = 0; h->buckets == NULL && i < h->len; i++) {\
+        if (h->key_destructor != NULL) h->key_destructor(&hmap_##K##_##V##_small(h)[i].key);\
+        if (h->value_destructor != NULL) h->value_destructor(&hmap_##K##_##V##_small(h)[i].value);\
+    }\
+    for (uint32_t i = 0; h->buckets != NULL && i < h->cap; i++) {\
         hmap_##K##_##V##_entry *e = h->buckets[i];\
         while (e != NULL) {\
             hmap_##K##_##V##_entry *next = e->next;\
@@ -271,5 +737,5 @@ void hmap_##K##_##V##_destroy(hmap_##K##_##V *h)\
             e = next;\
         }\
     }\
-    free(h->buckets);\
+    hmap_buckets_free(h->buckets, h->cap * sizeof(*h->buckets));\
 }
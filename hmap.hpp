@@ -0,0 +1,305 @@
+/*
+ * Implements the hashmap of hmap.h as a C++ template: the same chained buckets, power of 2 capacity, load factor and
+ * hash mixing, with constructors and destructors run for keys and values.
+ * Keys and values are moved or constructed in place, never copied, so both can be move-only types. Hash and Eq are
+ * functors called directly, so they can be inlined.
+ * Usage
+ * =====
+ * hmap::map<K, V, Hash = std::hash<K>, Eq = std::equal_to<K>>
+ *     Hash: callable as hash(const K &), returning an integer which is folded to 32 bits.
+ *     Eq:   callable as eq(const K &, const K &), returning bool.
+ * for (auto &e : h)
+ *     Iterates the entries, e.key and e.value. Modifying the map or key is forbidden.
+ *
+ * Functions
+ * =========
+ * map(float load_factor = HMAP_DEFAULT_LOAD_FACTOR, uint32_t initial_capacity = HMAP_DEFAULT_INITIAL_CAPACITY):
+ *     Creates an empty map. initial capacity is rounded to next power of 2. The map is movable, but not copyable.
+ *
+ * std::pair<V *, bool> try_emplace(KK &&key, Args &&...args):
+ *     If key is absent, inserts it, moved or copied from key as KK allows, with a value constructed in place from
+ *     args. Returns a pointer to the value of key, and whether it was inserted.
+ *
+ * std::pair<V *, bool> insert_or_assign(KK &&key, VV &&value):
+ *     As try_emplace, but assigns value to the existing value if key is present.
+ *
+ * V &operator[](KK &&key):
+ *     Returns the value of key, inserting a value initialised one if it is absent.
+ *
+ * V *get(const K &key):
+ *     Gets a pointer to the value associated with the key; returns nullptr if it doesn't exist.
+ *     If Hash and Eq both define is_transparent, get and remove also take any type they accept, such as a
+ *     std::string_view for std::string keys, without building a K. Such a probe must hash as the equal key does.
+ *
+ * bool remove(const K &key):
+ *     Removes the entry associated with the key, destroying the key and value.
+ *     Returns true if removed, false if it doesn't exist.
+ *
+ * uint32_t size():
+ *     Returns the number of entries.
+ *
+ * void clear():
+ *     Removes every entry, keeping the buckets.
+ *
+ * Example
+ * =======
+ * hmap::map<std::string, std::unique_ptr<int>> h;
+ * h.try_emplace("one", new int(1));
+ * std::string key = "two";
+ * h.try_emplace(std::move(key), std::make_unique<int>(2)); // key moved into the map
+ * printf("%d", **h.get("one")); // 1
+ * h.remove("two");
+ * printf("%" PRIu32, h.size()); // 1
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#include "hmap.h"
+
+namespace hmap {
+
+template <class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>>
+class map {
+public:
+    struct entry {
+        template <class KK, class... Args>
+        entry(uint32_t hash, KK &&key, Args &&...args)
+            : hash(hash), key(std::forward<KK>(key)), value(std::forward<Args>(args)...), next(nullptr) {}
+
+        uint32_t hash;
+        const K  key;
+        V        value;
+        entry    *next;
+    };
+
+    template <bool Const>
+    class iter {
+        using map_type = typename std::conditional<Const, const map, map>::type;
+        using entry_type = typename std::conditional<Const, const entry, entry>::type;
+    public:
+        iter(map_type *h, uint32_t i, entry *e) : h(h), i(i), e(e) { skip(); }
+        entry_type &operator*() const { return *e; }
+        entry_type *operator->() const { return e; }
+        iter &operator++() { e = e->next; skip(); return *this; }
+        bool operator==(const iter &other) const { return e == other.e; }
+        bool operator!=(const iter &other) const { return e != other.e; }
+    private:
+        void skip()
+        {
+            while (e == nullptr && ++i < h->cap)
+                e = h->buckets[i];
+        }
+        map_type *h;
+        uint32_t i;
+        entry    *e;
+    };
+    using iterator = iter<false>;
+    using const_iterator = iter<true>;
+
+    explicit map(float load_factor = HMAP_DEFAULT_LOAD_FACTOR, uint32_t initial_capacity = HMAP_DEFAULT_INITIAL_CAPACITY,
+                 const Hash &hash = Hash(), const Eq &eq = Eq())
+        : len(0), cap(1), load_factor(load_factor), hash_fn(hash), eq_fn(eq)
+    {
+        while (cap < initial_capacity)
+            cap <<= 1;
+        threshold = load_factor * cap;
+        buckets = new entry *[cap]();
+    }
+
+    /* other is left empty without buckets, which its next insert allocates */
+    map(map &&other) noexcept
+        : len(other.len), cap(other.cap), load_factor(other.load_factor), threshold(other.threshold),
+          buckets(other.buckets), hash_fn(std::move(other.hash_fn)), eq_fn(std::move(other.eq_fn))
+    {
+        other.len = 0;
+        other.cap = 0;
+        other.threshold = 0;
+        other.buckets = nullptr;
+    }
+
+    map &operator=(map &&other) noexcept
+    {
+        if (this != &other) {
+            clear();
+            delete[] buckets;
+            len = other.len;
+            cap = other.cap;
+            load_factor = other.load_factor;
+            threshold = other.threshold;
+            buckets = other.buckets;
+            hash_fn = std::move(other.hash_fn);
+            eq_fn = std::move(other.eq_fn);
+            other.len = 0;
+            other.cap = 0;
+            other.threshold = 0;
+            other.buckets = nullptr;
+        }
+        return *this;
+    }
+
+    map(const map &) = delete;
+    map &operator=(const map &) = delete;
+
+    ~map()
+    {
+        clear();
+        delete[] buckets;
+    }
+
+    template <class KK, class... Args>
+    std::pair<V *, bool> try_emplace(KK &&key, Args &&...args)
+    {
+        uint32_t hash = hash_of(key);
+        entry **e = find(key, hash);
+        if (*e != nullptr)
+            return {&(*e)->value, false};
+        if (len >= threshold) {
+            resize();
+            e = find(key, hash);
+        }
+        /* linked only once constructed, so a throwing constructor leaves the map unchanged */
+        *e = new entry(hash, std::forward<KK>(key), std::forward<Args>(args)...);
+        len++;
+        return {&(*e)->value, true};
+    }
+
+    template <class KK, class VV>
+    std::pair<V *, bool> insert_or_assign(KK &&key, VV &&value)
+    {
+        std::pair<V *, bool> r = try_emplace(std::forward<KK>(key), std::forward<VV>(value));
+        if (!r.second)
+            *r.first = std::forward<VV>(value);
+        return r;
+    }
+
+    template <class KK>
+    V &operator[](KK &&key)
+    {
+        return *try_emplace(std::forward<KK>(key)).first;
+    }
+
+    V *get(const K &key)
+    {
+        entry *e = *find(key, hash_of(key));
+        return e != nullptr ? &e->value : nullptr;
+    }
+
+    const V *get(const K &key) const
+    {
+        return const_cast<map *>(this)->get(key);
+    }
+
+    template <class KK, class H = Hash, class E = Eq, class = typename H::is_transparent, class = typename E::is_transparent>
+    V *get(const KK &key)
+    {
+        entry *e = *find(key, hash_of(key));
+        return e != nullptr ? &e->value : nullptr;
+    }
+
+    template <class KK, class H = Hash, class E = Eq, class = typename H::is_transparent, class = typename E::is_transparent>
+    const V *get(const KK &key) const
+    {
+        return const_cast<map *>(this)->get(key);
+    }
+
+    bool remove(const K &key)
+    {
+        return remove_at(find(key, hash_of(key)));
+    }
+
+    template <class KK, class H = Hash, class E = Eq, class = typename H::is_transparent, class = typename E::is_transparent>
+    bool remove(const KK &key)
+    {
+        return remove_at(find(key, hash_of(key)));
+    }
+
+    uint32_t size() const { return len; }
+
+    void clear()
+    {
+        for (uint32_t i = 0; i < cap; i++) {
+            for (entry *e = buckets[i]; e != nullptr;) {
+                entry *next = e->next;
+                delete e;
+                e = next;
+            }
+            buckets[i] = nullptr;
+        }
+        len = 0;
+    }
+
+    iterator begin() { return iterator(this, 0, cap > 0 ? buckets[0] : nullptr); }
+    iterator end() { return iterator(this, cap, nullptr); }
+    const_iterator begin() const { return const_iterator(this, 0, cap > 0 ? buckets[0] : nullptr); }
+    const_iterator end() const { return const_iterator(this, cap, nullptr); }
+
+private:
+    template <class KK>
+    uint32_t hash_of(const KK &key) const
+    {
+        /* fold the hash to 32 bits before mixing it */
+        uint64_t full = static_cast<uint64_t>(hash_fn(key));
+        return hmap_mix(static_cast<uint32_t>(full ^ (full >> 32)));
+    }
+
+    /* returns the link pointing at the entry of key, or the null link ending its chain */
+    template <class KK>
+    entry **find(const KK &key, uint32_t hash) const
+    {
+        if (cap == 0)
+            return const_cast<entry **>(&no_entry);
+        entry **e = &buckets[hash & (cap - 1)];
+        for (; *e != nullptr; e = &(*e)->next) {
+            if ((*e)->hash == hash && eq_fn((*e)->key, key))
+                break;
+        }
+        return e;
+    }
+
+    bool remove_at(entry **prev_next)
+    {
+        entry *e = *prev_next;
+        if (e == nullptr)
+            return false;
+        *prev_next = e->next;
+        delete e;
+        len--;
+        return true;
+    }
+
+    void resize()
+    {
+        uint32_t new_cap = cap != 0 ? cap << 1 : HMAP_DEFAULT_INITIAL_CAPACITY;
+        entry **new_buckets = new entry *[new_cap]();
+        for (uint32_t i = 0; i < cap; i++) {
+            for (entry *e = buckets[i]; e != nullptr;) {
+                entry *next = e->next;
+                e->next = new_buckets[e->hash & (new_cap - 1)];
+                new_buckets[e->hash & (new_cap - 1)] = e;
+                e = next;
+            }
+        }
+        delete[] buckets;
+        buckets = new_buckets;
+        cap = new_cap;
+        threshold = load_factor * cap;
+    }
+
+    uint32_t len;
+    uint32_t cap;
+    float    load_factor;
+    uint32_t threshold;
+    entry    **buckets;
+    Hash     hash_fn;
+    Eq       eq_fn;
+    /* the chain a map without buckets finds for every key */
+    entry    *no_entry = nullptr;
+};
+
+}
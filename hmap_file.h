@@ -0,0 +1,555 @@
+/*
+ * Implements a generic hashmap stored in a file, which survives crashes and restarts without being reloaded.
+ * The file is mapped privately, so modifications never reach it behind the map's back. Every byte range a change
+ * touches is recorded, and commit appends the new contents of those ranges to a redo log next to the file
+ * (path + ".log") and syncs it. Once the log grows past HMAP_FILE_CHECKPOINT_BYTES, a checkpoint writes the modified
+ * pages into the file, syncs it and empties the log. Opening the map replays the complete commits of the log, so
+ * after a crash the map is in the state of the last completed commit, and it is usable as soon as open returns.
+ * Entries link to each other by offsets in the file. The file has a fixed size chosen at creation, and is sparse
+ * until written. Keys and values are copied bitwise and must not contain pointers.
+ * A map is used by one thread at a time.
+ * Usage
+ * =====
+ * HMAP_FILE_DECLARE(K, V)
+ *     Defines structures hmap_file_K_V and hmap_file_K_V_entry, and declares the functions.
+ *     If K or V is a pointer, then it has to be typedef'd.
+ * HMAP_FILE_DEFINE(K, V, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ *
+ * Functions
+ * =========
+ * int hmap_file_K_V_create(hmap_file_K_V *h, const char *path, size_t size, float load_factor, uint32_t initial_capacity):
+ *     Creates the file path of size bytes holding an empty map. Returns 0, or -1 with errno set.
+ *
+ * int hmap_file_K_V_open(hmap_file_K_V *h, const char *path):
+ *     Opens the map in the file path, recovering it from its log if required. Returns 0, or -1 with errno set; errno
+ *     is EINVAL if the file does not hold a map of this type, which is then left as it is, and ENOENT if the file
+ *     or its log is missing.
+ *
+ * V *hmap_file_K_V_put(hmap_file_K_V *h, const K *key):
+ *     As hmap_K_V_put. The value is recorded as it is at the next commit, so it can be written through the pointer.
+ *     Returns NULL if the file is out of space.
+ *
+ * V *hmap_file_K_V_get(const hmap_file_K_V *h, const K *key):
+ *     As hmap_K_V_get. Writes through the pointer are not recorded; use put to modify a value.
+ *
+ * bool hmap_file_K_V_remove(hmap_file_K_V *h, const K *key):
+ *     As hmap_K_V_remove.
+ *
+ * int hmap_file_K_V_commit(hmap_file_K_V *h):
+ *     Makes the changes since the previous commit durable, all of them or none. Returns 0, or -1 with errno set.
+ *
+ * int hmap_file_K_V_checkpoint(hmap_file_K_V *h):
+ *     Commits, then writes the modified pages into the file and empties the log. Returns 0, or -1 with errno set.
+ *
+ * int hmap_file_K_V_close(hmap_file_K_V *h):
+ *     Checkpoints and unmaps the map. Returns the result of the checkpoint.
+ *
+ * Example
+ * =======
+ * HMAP_FILE_DECLARE(int, int)
+ * HMAP_FILE_DEFINE(int, int, hash_func, eq_func)
+ *
+ * hmap_file_int_int h;
+ * if (hmap_file_int_int_open(&h, "map.db") != 0)
+ *     hmap_file_int_int_create(&h, "map.db", 1ull << 30, HMAP_DEFAULT_LOAD_FACTOR, HMAP_DEFAULT_INITIAL_CAPACITY);
+ * *hmap_file_int_int_put(&h, &(int){1}) = 2;
+ * hmap_file_int_int_commit(&h); // survives a crash from here on
+ * hmap_file_int_int_close(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hmap.h"
+
+#define HMAP_FILE_MAGIC            0x31454c4946504d48ull
+#define HMAP_FILE_PAGE             4096
+#define HMAP_FILE_CHECKPOINT_BYTES (64u << 20)
+
+/* offsets are from the start of the file, and 0 means none */
+typedef struct hmap_file_header {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t used;
+    uint64_t free_list;
+    uint64_t buckets;
+    uint32_t entry_size;
+    uint32_t len;
+    uint32_t cap;
+    float    load_factor;
+    uint32_t threshold;
+} hmap_file_header;
+
+typedef struct hmap_file_range {
+    uint64_t off;
+    uint64_t len;
+} hmap_file_range;
+
+typedef struct hmap_file_region {
+    hmap_file_header *hdr;
+    char             *base;
+    size_t           size;
+    int              fd;
+    int              log_fd;
+    uint64_t         log_bytes;
+    /* ranges changed since the last commit */
+    hmap_file_range  *ranges;
+    uint32_t         ranges_len;
+    uint32_t         ranges_cap;
+    /* one bit per page changed since the last checkpoint */
+    uint8_t          *dirty;
+} hmap_file_region;
+
+static inline uint64_t hmap_file_checksum(const char *data, size_t len)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static inline void hmap_file_mark_dirty(hmap_file_region *r, uint64_t off, uint64_t len)
+{
+    for (uint64_t page = off / HMAP_FILE_PAGE; page <= (off + len - 1) / HMAP_FILE_PAGE; page++)
+        r->dirty[page / 8] |= 1 << (page % 8);
+}
+
+/* records that the len bytes at ptr in the mapping are about to change or have changed */
+static inline void hmap_file_touch(hmap_file_region *r, const void *ptr, uint64_t len)
+{
+    if (r->ranges_len == r->ranges_cap) {
+        r->ranges_cap = r->ranges_cap ? 2 * r->ranges_cap : 64;
+        r->ranges = realloc(r->ranges, r->ranges_cap * sizeof(*r->ranges));
+    }
+    uint64_t off = (const char *)ptr - r->base;
+    r->ranges[r->ranges_len++] = (hmap_file_range){off, len};
+    hmap_file_mark_dirty(r, off, len);
+}
+
+static inline int hmap_file_write_all(int fd, const char *data, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* a commit is appended to the log as: uint64_t payload length, payload, uint64_t checksum of the payload;
+ * the payload is a sequence of uint64_t offset, uint64_t length, bytes */
+static inline int hmap_file_commit(hmap_file_region *r)
+{
+    if (r->ranges_len == 0)
+        return 0;
+    hmap_file_touch(r, r->hdr, sizeof(*r->hdr));
+    uint64_t payload = 0;
+    for (uint32_t i = 0; i < r->ranges_len; i++)
+        payload += 2 * sizeof(uint64_t) + r->ranges[i].len;
+    size_t total = sizeof(uint64_t) + payload + sizeof(uint64_t);
+    char *buf = malloc(total);
+    char *p = buf;
+    memcpy(p, &payload, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    for (uint32_t i = 0; i < r->ranges_len; i++) {
+        memcpy(p, &r->ranges[i].off, sizeof(uint64_t));
+        memcpy(p + sizeof(uint64_t), &r->ranges[i].len, sizeof(uint64_t));
+        p += 2 * sizeof(uint64_t);
+        memcpy(p, r->base + r->ranges[i].off, r->ranges[i].len);
+        p += r->ranges[i].len;
+    }
+    uint64_t checksum = hmap_file_checksum(buf + sizeof(uint64_t), payload);
+    memcpy(p, &checksum, sizeof(uint64_t));
+    int ret = hmap_file_write_all(r->log_fd, buf, total, r->log_bytes);
+    if (ret == 0)
+        ret = fdatasync(r->log_fd);
+    free(buf);
+    if (ret != 0)
+        return -1;
+    r->log_bytes += total;
+    r->ranges_len = 0;
+    return 0;
+}
+
+static inline int hmap_file_checkpoint(hmap_file_region *r)
+{
+    if (hmap_file_commit(r) != 0)
+        return -1;
+    if (r->log_bytes == 0)
+        return 0;
+    for (uint64_t page = 0; page < r->size / HMAP_FILE_PAGE; page++) {
+        if (!(r->dirty[page / 8] & (1 << (page % 8))))
+            continue;
+        if (hmap_file_write_all(r->fd, r->base + page * HMAP_FILE_PAGE, HMAP_FILE_PAGE, page * HMAP_FILE_PAGE) != 0)
+            return -1;
+    }
+    /* the log may only go once the pages it describes are durable */
+    if (fdatasync(r->fd) != 0 || ftruncate(r->log_fd, 0) != 0 || fdatasync(r->log_fd) != 0)
+        return -1;
+    memset(r->dirty, 0, (r->size / HMAP_FILE_PAGE + 7) / 8);
+    r->log_bytes = 0;
+    return 0;
+}
+
+/* applies every complete commit of the log to the mapping */
+static inline int hmap_file_replay(hmap_file_region *r)
+{
+    struct stat st;
+    if (fstat(r->log_fd, &st) != 0)
+        return -1;
+    char *log = malloc(st.st_size + 1);
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = pread(r->log_fd, log + len, st.st_size - len, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    size_t pos = 0;
+    for (;;) {
+        uint64_t payload, checksum;
+        if (len - pos < 2 * sizeof(uint64_t))
+            break;
+        memcpy(&payload, log + pos, sizeof(uint64_t));
+        if (payload > len - pos - 2 * sizeof(uint64_t))
+            break;
+        const char *p = log + pos + sizeof(uint64_t);
+        memcpy(&checksum, p + payload, sizeof(uint64_t));
+        if (checksum != hmap_file_checksum(p, payload))
+            break;
+        for (const char *end = p + payload; p < end;) {
+            uint64_t off, n;
+            memcpy(&off, p, sizeof(uint64_t));
+            memcpy(&n, p + sizeof(uint64_t), sizeof(uint64_t));
+            p += 2 * sizeof(uint64_t);
+            if (off + n > r->size || n > (uint64_t)(end - p))
+                break;
+            memcpy(r->base + off, p, n);
+            hmap_file_mark_dirty(r, off, n);
+            p += n;
+        }
+        pos += 2 * sizeof(uint64_t) + payload;
+    }
+    free(log);
+    /* anything after the last complete commit is garbage, which the checkpoint following replay removes */
+    r->log_bytes = len;
+    return 0;
+}
+
+/* size is 0 to map the whole of an existing file, whose log must exist; otherwise the log is created empty */
+static inline int hmap_file_map(hmap_file_region *r, const char *path, int flags, size_t size)
+{
+    bool existing = size == 0;
+    r->fd = open(path, flags, 0600);
+    r->log_fd = -1;
+    void *base = MAP_FAILED;
+    struct stat st;
+    if (r->fd < 0)
+        goto fail;
+    if (size != 0 && ftruncate(r->fd, size) != 0)
+        goto fail;
+    if (size == 0 && fstat(r->fd, &st) != 0)
+        goto fail;
+    if (size == 0)
+        size = st.st_size;
+    if (size < HMAP_FILE_PAGE || size % HMAP_FILE_PAGE != 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, r->fd, 0);
+    if (base == MAP_FAILED)
+        goto fail;
+    /* an existing file must hold a map before its log is touched */
+    const hmap_file_header *hdr = base;
+    if (existing && (hdr->magic != HMAP_FILE_MAGIC || hdr->size != size)) {
+        munmap(base, size);
+        base = MAP_FAILED;
+        errno = EINVAL;
+        goto fail;
+    }
+    char *log_path = malloc(strlen(path) + sizeof(".log"));
+    strcpy(log_path, path);
+    strcat(log_path, ".log");
+    r->log_fd = open(log_path, existing ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0600);
+    free(log_path);
+    if (r->log_fd < 0) {
+        munmap(base, size);
+        base = MAP_FAILED;
+    }
+fail:
+    if (base == MAP_FAILED) {
+        int err = errno;
+        if (r->fd >= 0) close(r->fd);
+        if (r->log_fd >= 0) close(r->log_fd);
+        errno = err;
+        return -1;
+    }
+    r->base = base;
+    r->hdr = base;
+    r->size = size;
+    r->log_bytes = 0;
+    r->ranges = NULL;
+    r->ranges_len = 0;
+    r->ranges_cap = 0;
+    r->dirty = calloc((size / HMAP_FILE_PAGE + 7) / 8, 1);
+    return 0;
+}
+
+static inline void hmap_file_unmap(hmap_file_region *r)
+{
+    munmap(r->base, r->size);
+    close(r->fd);
+    close(r->log_fd);
+    free(r->ranges);
+    free(r->dirty);
+}
+
+static inline int hmap_file_region_create(hmap_file_region *r, const char *path, size_t size)
+{
+    size = (size + HMAP_FILE_PAGE - 1) / HMAP_FILE_PAGE * HMAP_FILE_PAGE;
+    if (hmap_file_map(r, path, O_RDWR | O_CREAT | O_EXCL, size) != 0)
+        return -1;
+    r->hdr->magic = HMAP_FILE_MAGIC;
+    r->hdr->size = size;
+    r->hdr->used = sizeof(hmap_file_header);
+    r->hdr->free_list = 0;
+    return 0;
+}
+
+static inline int hmap_file_region_open(hmap_file_region *r, const char *path, uint32_t entry_size)
+{
+    if (hmap_file_map(r, path, O_RDWR, 0) != 0)
+        return -1;
+    if (r->hdr->entry_size != entry_size) {
+        hmap_file_unmap(r);
+        errno = EINVAL;
+        return -1;
+    }
+    if (hmap_file_replay(r) != 0 || hmap_file_checkpoint(r) != 0) {
+        int err = errno;
+        hmap_file_unmap(r);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* bump allocates size bytes; 0 if the file is full */
+static inline uint64_t hmap_file_alloc(hmap_file_region *r, uint64_t size)
+{
+    uint64_t align = _Alignof(max_align_t);
+    uint64_t off = (r->hdr->used + align - 1) & ~(align - 1);
+    if (off + size > r->hdr->size)
+        return 0;
+    r->hdr->used = off + size;
+    return off;
+}
+
+#define HMAP_FILE_DECLARE(K, V) \
+typedef struct hmap_file_##K##_##V##_entry {\
+    uint64_t next;\
+    uint32_t hash;\
+    K        key;\
+    V        value;\
+} hmap_file_##K##_##V##_entry;\
+\
+typedef struct hmap_file_##K##_##V {\
+    hmap_file_region region;\
+} hmap_file_##K##_##V;\
+\
+int  hmap_file_##K##_##V##_create(hmap_file_##K##_##V *h, const char *path, size_t size, float load_factor, uint32_t initial_capacity);\
+int  hmap_file_##K##_##V##_open(hmap_file_##K##_##V *h, const char *path);\
+V   *hmap_file_##K##_##V##_put(hmap_file_##K##_##V *h, const K *key);\
+V   *hmap_file_##K##_##V##_get(const hmap_file_##K##_##V *h, const K *key);\
+bool hmap_file_##K##_##V##_remove(hmap_file_##K##_##V *h, const K *key);\
+int  hmap_file_##K##_##V##_commit(hmap_file_##K##_##V *h);\
+int  hmap_file_##K##_##V##_checkpoint(hmap_file_##K##_##V *h);\
+int  hmap_file_##K##_##V##_close(hmap_file_##K##_##V *h);
+
+#define HMAP_FILE_DEFINE(K, V, hash_func, eq_func)\
+static inline hmap_file_##K##_##V##_entry *hmap_file_##K##_##V##_at(const hmap_file_##K##_##V *h, uint64_t off)\
+{\
+    return off != 0 ? (hmap_file_##K##_##V##_entry *)(h->region.base + off) : NULL;\
+}\
+\
+static inline uint64_t *hmap_file_##K##_##V##_buckets(const hmap_file_##K##_##V *h)\
+{\
+    return (uint64_t *)(h->region.base + h->region.hdr->buckets);\
+}\
+\
+int hmap_file_##K##_##V##_create(hmap_file_##K##_##V *h, const char *path, size_t size, float load_factor, uint32_t initial_capacity)\
+{\
+    if (hmap_file_region_create(&h->region, path, size) != 0)\
+        return -1;\
+    hmap_file_header *hdr = h->region.hdr;\
+    uint32_t cap = 1;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    hdr->entry_size = sizeof(hmap_file_##K##_##V##_entry);\
+    hdr->len = 0;\
+    hdr->cap = cap;\
+    hdr->load_factor = load_factor;\
+    hdr->threshold = load_factor * cap;\
+    /* the file is zero filled, so the buckets are already empty */\
+    hdr->buckets = hmap_file_alloc(&h->region, cap * sizeof(uint64_t));\
+    hmap_file_touch(&h->region, hdr, sizeof(*hdr));\
+    if (hdr->buckets == 0 || hmap_file_checkpoint(&h->region) != 0) {\
+        int err = hdr->buckets == 0 ? ENOMEM : errno;\
+        hmap_file_unmap(&h->region);\
+        unlink(path);\
+        errno = err;\
+        return -1;\
+    }\
+    return 0;\
+}\
+\
+int hmap_file_##K##_##V##_open(hmap_file_##K##_##V *h, const char *path)\
+{\
+    return hmap_file_region_open(&h->region, path, sizeof(hmap_file_##K##_##V##_entry));\
+}\
+\
+static uint32_t hmap_file_##K##_##V##_hash(const K *key) \
+{\
+    return hmap_mix(hash_func(key));\
+}\
+\
+static void hmap_file_##K##_##V##_free_entry(hmap_file_##K##_##V *h, uint64_t off)\
+{\
+    hmap_file_##K##_##V##_entry *e = hmap_file_##K##_##V##_at(h, off);\
+    hmap_file_touch(&h->region, &e->next, sizeof(e->next));\
+    e->next = h->region.hdr->free_list;\
+    h->region.hdr->free_list = off;\
+}\
+\
+static void hmap_file_##K##_##V##_resize(hmap_file_##K##_##V *h)\
+{\
+    hmap_file_header *hdr = h->region.hdr;\
+    uint32_t cap = hdr->cap << 1;\
+    uint64_t buckets_off = hmap_file_alloc(&h->region, cap * sizeof(uint64_t));\
+    if (buckets_off == 0)\
+        return;\
+    uint64_t *old = hmap_file_##K##_##V##_buckets(h);\
+    uint64_t *buckets = (uint64_t *)(h->region.base + buckets_off);\
+    memset(buckets, 0, cap * sizeof(uint64_t));\
+    hmap_file_touch(&h->region, buckets, cap * sizeof(uint64_t));\
+    for (uint32_t i = 0; i < hdr->cap; i++) {\
+        uint64_t off = old[i];\
+        while (off != 0) {\
+            hmap_file_##K##_##V##_entry *e = hmap_file_##K##_##V##_at(h, off);\
+            uint64_t next = e->next;\
+            hmap_file_touch(&h->region, &e->next, sizeof(e->next));\
+            e->next = buckets[e->hash & (cap - 1)];\
+            buckets[e->hash & (cap - 1)] = off;\
+            off = next;\
+        }\
+    }\
+    /* the old bucket array cannot be returned to the bump allocator, so it is carved into free entries */\
+    uint64_t old_off = hdr->buckets;\
+    uint64_t old_end = old_off + hdr->cap * sizeof(uint64_t);\
+    for (; old_off + sizeof(hmap_file_##K##_##V##_entry) <= old_end; old_off += sizeof(hmap_file_##K##_##V##_entry))\
+        hmap_file_##K##_##V##_free_entry(h, old_off);\
+    hdr->buckets = buckets_off;\
+    hdr->cap = cap;\
+    hdr->threshold = hdr->load_factor * cap;\
+}\
+\
+static uint64_t *hmap_file_##K##_##V##_find(const hmap_file_##K##_##V *h, const K *key, uint32_t hash)\
+{\
+    uint64_t *off = &hmap_file_##K##_##V##_buckets(h)[hash & (h->region.hdr->cap - 1)];\
+    for (; *off != 0; off = &hmap_file_##K##_##V##_at(h, *off)->next) {\
+        hmap_file_##K##_##V##_entry *e = hmap_file_##K##_##V##_at(h, *off);\
+        if (e->hash == hash && eq_func(&e->key, key)) {\
+            break;\
+        }\
+    }\
+    return off;\
+}\
+\
+V *hmap_file_##K##_##V##_put(hmap_file_##K##_##V *h, const K *key)\
+{\
+    hmap_file_header *hdr = h->region.hdr;\
+    if (hdr->len >= hdr->threshold) {\
+        hmap_file_##K##_##V##_resize(h);\
+    }\
+    uint32_t hash = hmap_file_##K##_##V##_hash(key);\
+    uint64_t *off = hmap_file_##K##_##V##_find(h, key, hash);\
+    if (*off == 0) {\
+        uint64_t new_off = hdr->free_list;\
+        if (new_off != 0)\
+            hdr->free_list = hmap_file_##K##_##V##_at(h, new_off)->next;\
+        else\
+            new_off = hmap_file_alloc(&h->region, sizeof(hmap_file_##K##_##V##_entry));\
+        if (new_off == 0)\
+            return NULL;\
+        hmap_file_##K##_##V##_entry *e = hmap_file_##K##_##V##_at(h, new_off);\
+        hmap_file_touch(&h->region, e, offsetof(hmap_file_##K##_##V##_entry, value));\
+        e->next = 0;\
+        e->hash = hash;\
+        e->key = *key;\
+        hmap_file_touch(&h->region, off, sizeof(*off));\
+        *off = new_off;\
+        hdr->len++;\
+    }\
+    hmap_file_##K##_##V##_entry *e = hmap_file_##K##_##V##_at(h, *off);\
+    hmap_file_touch(&h->region, &e->value, sizeof(e->value));\
+    return &e->value;\
+}\
+\
+V *hmap_file_##K##_##V##_get(const hmap_file_##K##_##V *h, const K *key)\
+{\
+    hmap_file_##K##_##V##_entry *e = hmap_file_##K##_##V##_at(h, *hmap_file_##K##_##V##_find(h, key, hmap_file_##K##_##V##_hash(key)));\
+    return e != NULL ? &e->value : NULL;\
+}\
+\
+bool hmap_file_##K##_##V##_remove(hmap_file_##K##_##V *h, const K *key)\
+{\
+    uint64_t *prev_next = hmap_file_##K##_##V##_find(h, key, hmap_file_##K##_##V##_hash(key));\
+    uint64_t off = *prev_next;\
+    if (off == 0)\
+        return false;\
+    hmap_file_touch(&h->region, prev_next, sizeof(*prev_next));\
+    *prev_next = hmap_file_##K##_##V##_at(h, off)->next;\
+    hmap_file_##K##_##V##_free_entry(h, off);\
+    h->region.hdr->len--;\
+    return true;\
+}\
+\
+int hmap_file_##K##_##V##_commit(hmap_file_##K##_##V *h)\
+{\
+    if (hmap_file_commit(&h->region) != 0)\
+        return -1;\
+    return h->region.log_bytes >= HMAP_FILE_CHECKPOINT_BYTES ? hmap_file_checkpoint(&h->region) : 0;\
+}\
+\
+int hmap_file_##K##_##V##_checkpoint(hmap_file_##K##_##V *h)\
+{\
+    return hmap_file_checkpoint(&h->region);\
+}\
+\
+int hmap_file_##K##_##V##_close(hmap_file_##K##_##V *h)\
+{\
+    int ret = hmap_file_checkpoint(&h->region);\
+    hmap_file_unmap(&h->region);\
+    return ret;\
+}
@@ -0,0 +1,326 @@
+/*
+ * Implements a hashmap specialised for integer keys.
+ * Keys are kept in a dense array split into groups of HMAP_INT_GROUP slots, and a lookup compares a whole group at
+ * once with SSE2 or AVX2 (picked at runtime, with a scalar fallback elsewhere) for 4 and 8 byte keys. The key is its
+ * own hash input, so there is neither a hash_func nor a stored hash. Values are kept in a parallel array.
+ * Usage
+ * =====
+ * HMAP_DECLARE_INT(K, V)
+ *     Defines structure hmap_K_V, and declares the functions. K must be an integer type.
+ *     If V is a pointer, then it has to be typedef'd.
+ * HMAP_DEFINE_INT(K, V)
+ *     Defines the functions.
+ * HMAP_INT_ITER_BEGIN(h, index_name)
+ *     Starts a for loop where index_name is the slot of an entry, whose key and value are
+ *     h->keys[index_name] and h->values[index_name].
+ *     Modifying the hashmap or key is forbidden.
+ * HMAP_INT_ITER_END
+ *     Ends the for loop
+ * There should not be any semicolon after the macros.
+ *
+ * Functions
+ * =========
+ * void hmap_K_V_init_custom(hmap_K_V *h, float load_factor, uint32_t initial_capacity, void (*value_destructor)(V *value)):
+ *     Initiates the hashmap with given parameters. initial capacity is rounded to next power of 2, and to at least
+ *     two groups. load_factor must be less than 1. Destructor can be NULL in which case it is ignored.
+ *
+ * void hmap_K_V_init(hmap_K_V *h, void (*value_destructor)(V *value)):
+ *     init_custom with default parameters + destructor forwarded.
+ *
+ * V *hmap_K_V_put(hmap_K_V *h, K key):
+ *     Puts the key, returning a pointer to the value.
+ *     Values move when the map is modified, so the pointer is only valid until the next put or remove.
+ *
+ * V *hmap_K_V_get(const hmap_K_V *h, K key):
+ *     Gets a pointer to the value associated with the key; returns NULL if it doesn't exist.
+ *
+ * bool hmap_K_V_remove(hmap_K_V *h, K key):
+ *     Removes the key from the map, calling destructor for the value.
+ *     Returns true if removed, false if it doesn't exist.
+ *
+ * void hmap_K_V_destroy(hmap_K_V *h):
+ *     Destroys the map by freeing memory, and calling destructor of values.
+ *
+ * Example
+ * =======
+ * HMAP_DECLARE_INT(uint64_t, uint32_t)
+ * HMAP_DEFINE_INT(uint64_t, uint32_t)
+ *
+ * hmap_uint64_t_uint32_t h;
+ * hmap_uint64_t_uint32_t_init(&h, NULL);
+ * *hmap_uint64_t_uint32_t_put(&h, 1) = 2;
+ * printf("%" PRIu32, *hmap_uint64_t_uint32_t_get(&h, 1)); // 2
+ * hmap_uint64_t_uint32_t_remove(&h, 1);
+ * hmap_uint64_t_uint32_t_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hmap.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define HMAP_INT_GROUP      8
+/* low bits of a group's count byte; the high bit records that an insert once found the group full and moved on */
+#define HMAP_INT_COUNT_MASK 0x7f
+#define HMAP_INT_OVERFLOWED 0x80
+
+/* each returns a bitmask of the slots among the HMAP_INT_GROUP keys at keys that equal key */
+static inline uint32_t hmap_int_match32(const void *keys, uint32_t key);
+static inline uint32_t hmap_int_match64(const void *keys, uint64_t key);
+
+#if defined(__SSE2__)
+__attribute__((target("avx2")))
+static uint32_t hmap_int_match32_avx2(const void *keys, uint32_t key)
+{
+    __m256i k = _mm256_loadu_si256((const __m256i *)keys);
+    __m256i eq = _mm256_cmpeq_epi32(k, _mm256_set1_epi32(key));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+__attribute__((target("avx2")))
+static uint32_t hmap_int_match64_avx2(const void *keys, uint64_t key)
+{
+    __m256i needle = _mm256_set1_epi64x(key);
+    __m256i lo = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)keys), needle);
+    __m256i hi = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)keys + 1), needle);
+    return _mm256_movemask_pd(_mm256_castsi256_pd(lo)) | _mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+}
+
+static inline uint32_t hmap_int_match32(const void *keys, uint32_t key)
+{
+    if (__builtin_cpu_supports("avx2"))
+        return hmap_int_match32_avx2(keys, key);
+    __m128i needle = _mm_set1_epi32(key);
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)keys), needle);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)keys + 1), needle);
+    return _mm_movemask_ps(_mm_castsi128_ps(lo)) | _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+}
+
+static inline uint32_t hmap_int_match64(const void *keys, uint64_t key)
+{
+    if (__builtin_cpu_supports("avx2"))
+        return hmap_int_match64_avx2(keys, key);
+    /* SSE2 has no 64 bit compare: a lane matches when both of its 32 bit halves do */
+    __m128i needle = _mm_set1_epi64x(key);
+    uint32_t mask = 0;
+    for (int i = 0; i < HMAP_INT_GROUP / 2; i++) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)keys + i), needle);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= _mm_movemask_pd(_mm_castsi128_pd(eq)) << (2 * i);
+    }
+    return mask;
+}
+#else
+static inline uint32_t hmap_int_match32(const void *keys, uint32_t key)
+{
+    const uint32_t *k = keys;
+    uint32_t mask = 0;
+    for (int i = 0; i < HMAP_INT_GROUP; i++)
+        mask |= (uint32_t)(k[i] == key) << i;
+    return mask;
+}
+
+static inline uint32_t hmap_int_match64(const void *keys, uint64_t key)
+{
+    const uint64_t *k = keys;
+    uint32_t mask = 0;
+    for (int i = 0; i < HMAP_INT_GROUP; i++)
+        mask |= (uint32_t)(k[i] == key) << i;
+    return mask;
+}
+#endif
+
+#define HMAP_INT_ITER_BEGIN(h, index_name) \
+for (uint32_t index_name = 0; index_name < (h)->cap; index_name++) {\
+    if (index_name % HMAP_INT_GROUP >= ((h)->counts[index_name / HMAP_INT_GROUP] & HMAP_INT_COUNT_MASK)) continue;\
+    {
+
+#define HMAP_INT_ITER_END \
+    }\
+}
+
+#define HMAP_DECLARE_INT(K, V) \
+typedef struct hmap_##K##_##V {\
+    uint32_t len;\
+    uint32_t cap;\
+    float    load_factor;\
+    uint32_t threshold;\
+    uint32_t shift;\
+    uint32_t overflowed;\
+    uint32_t overflow_limit;\
+    void     (*value_destructor)(V *value);\
+    uint8_t  *counts;\
+    K        *keys;\
+    V        *values;\
+} hmap_##K##_##V;\
+\
+void hmap_##K##_##V##_init_custom(hmap_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*value_destructor)(V *value));\
+void hmap_##K##_##V##_init(hmap_##K##_##V *h, void (*value_destructor)(V *value));\
+V   *hmap_##K##_##V##_put(hmap_##K##_##V *h, K key);\
+V   *hmap_##K##_##V##_get(const hmap_##K##_##V *h, K key);\
+bool hmap_##K##_##V##_remove(hmap_##K##_##V *h, K key);\
+void hmap_##K##_##V##_destroy(hmap_##K##_##V *h);
+
+#define HMAP_DEFINE_INT(K, V)\
+static void hmap_##K##_##V##_alloc(hmap_##K##_##V *h, uint32_t cap)\
+{\
+    uint32_t groups = cap / HMAP_INT_GROUP;\
+    h->cap = cap;\
+    h->threshold = h->load_factor * cap;\
+    h->shift = 64;\
+    while (groups > 1) {\
+        groups >>= 1;\
+        h->shift--;\
+    }\
+    h->overflowed = 0;\
+    h->overflow_limit = cap / HMAP_INT_GROUP / 4;\
+    h->counts = calloc(cap / HMAP_INT_GROUP, sizeof(*h->counts));\
+    /* empty slots are compared too and masked out afterwards; zeroing them keeps memory checkers quiet */\
+    h->keys = calloc(cap, sizeof(*h->keys));\
+    h->values = malloc(cap * sizeof(*h->values));\
+}\
+\
+void hmap_##K##_##V##_init_custom(hmap_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*value_destructor)(V *value))\
+{\
+    h->len = 0;\
+    uint32_t cap = 2 * HMAP_INT_GROUP;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    h->load_factor = load_factor;\
+    h->value_destructor = value_destructor;\
+    hmap_##K##_##V##_alloc(h, cap);\
+}\
+\
+void hmap_##K##_##V##_init(hmap_##K##_##V *h, void (*value_destructor)(V *value))\
+{\
+    hmap_##K##_##V##_init_custom(h, HMAP_DEFAULT_LOAD_FACTOR, HMAP_DEFAULT_INITIAL_CAPACITY, value_destructor);\
+}\
+\
+static inline uint32_t hmap_##K##_##V##_group(const hmap_##K##_##V *h, K key)\
+{\
+    /* fibonacci hashing: the top bits of the product depend on every bit of the key. folding the high half in first\
+     * keeps keys in arithmetic progression by a multiple of the constant from landing in a handful of groups */\
+    uint64_t x = (uint64_t)key;\
+    x ^= x >> 32;\
+    return (x * 0x9e3779b97f4a7c15ull) >> h->shift;\
+}\
+\
+static inline uint32_t hmap_##K##_##V##_match(const K *keys, K key)\
+{\
+    if (sizeof(K) == 4)\
+        return hmap_int_match32(keys, (uint32_t)key);\
+    if (sizeof(K) == 8)\
+        return hmap_int_match64(keys, (uint64_t)key);\
+    uint32_t mask = 0;\
+    for (int i = 0; i < HMAP_INT_GROUP; i++)\
+        mask |= (uint32_t)(keys[i] == key) << i;\
+    return mask;\
+}\
+\
+/* returns the slot holding key, or UINT32_MAX */\
+static uint32_t hmap_##K##_##V##_find(const hmap_##K##_##V *h, K key)\
+{\
+    uint32_t groups = h->cap / HMAP_INT_GROUP;\
+    uint32_t g = hmap_##K##_##V##_group(h, key);\
+    for (uint32_t n = 0; n < groups; n++, g = (g + 1) & (groups - 1)) {\
+        uint8_t count = h->counts[g];\
+        uint32_t m = hmap_##K##_##V##_match(&h->keys[g * HMAP_INT_GROUP], key);\
+        m &= (1u << (count & HMAP_INT_COUNT_MASK)) - 1;\
+        if (m != 0)\
+            return g * HMAP_INT_GROUP + __builtin_ctz(m);\
+        if (!(count & HMAP_INT_OVERFLOWED))\
+            break;\
+    }\
+    return UINT32_MAX;\
+}\
+\
+/* inserts a key known to be absent, returning its slot */\
+static uint32_t hmap_##K##_##V##_insert_new(hmap_##K##_##V *h, K key)\
+{\
+    uint32_t groups = h->cap / HMAP_INT_GROUP;\
+    uint32_t g = hmap_##K##_##V##_group(h, key);\
+    while ((h->counts[g] & HMAP_INT_COUNT_MASK) == HMAP_INT_GROUP) {\
+        if (!(h->counts[g] & HMAP_INT_OVERFLOWED)) {\
+            h->counts[g] |= HMAP_INT_OVERFLOWED;\
+            h->overflowed++;\
+        }\
+        g = (g + 1) & (groups - 1);\
+    }\
+    uint32_t slot = g * HMAP_INT_GROUP + (h->counts[g] & HMAP_INT_COUNT_MASK);\
+    h->counts[g]++;\
+    h->keys[slot] = key;\
+    return slot;\
+}\
+\
+/* rebuilds the map with cap slots, which also clears overflow marks left behind by removals */\
+static void hmap_##K##_##V##_rehash(hmap_##K##_##V *h, uint32_t cap)\
+{\
+    hmap_##K##_##V new = *h;\
+    hmap_##K##_##V##_alloc(&new, cap);\
+    HMAP_INT_ITER_BEGIN(h, i)\
+        uint32_t slot = hmap_##K##_##V##_insert_new(&new, h->keys[i]);\
+        new.values[slot] = h->values[i];\
+    HMAP_INT_ITER_END\
+    /* overflow that survives the rehash comes from the keys, and rehashing again would not remove it */\
+    new.overflow_limit += new.overflowed;\
+    free(h->counts);\
+    free(h->keys);\
+    free(h->values);\
+    *h = new;\
+}\
+\
+V *hmap_##K##_##V##_put(hmap_##K##_##V *h, K key)\
+{\
+    uint32_t slot = hmap_##K##_##V##_find(h, key);\
+    if (slot != UINT32_MAX)\
+        return &h->values[slot];\
+    if (h->len >= h->threshold)\
+        hmap_##K##_##V##_rehash(h, h->cap << 1);\
+    else if (h->overflowed > h->overflow_limit)\
+        hmap_##K##_##V##_rehash(h, h->cap);\
+    slot = hmap_##K##_##V##_insert_new(h, key);\
+    h->len++;\
+    return &h->values[slot];\
+}\
+\
+V *hmap_##K##_##V##_get(const hmap_##K##_##V *h, K key)\
+{\
+    uint32_t slot = hmap_##K##_##V##_find(h, key);\
+    return slot != UINT32_MAX ? &h->values[slot] : NULL;\
+}\
+\
+bool hmap_##K##_##V##_remove(hmap_##K##_##V *h, K key)\
+{\
+    uint32_t slot = hmap_##K##_##V##_find(h, key);\
+    if (slot == UINT32_MAX)\
+        return false;\
+    if (h->value_destructor != NULL) h->value_destructor(&h->values[slot]);\
+    /* keep the group dense by moving its last entry into the hole */\
+    uint32_t g = slot / HMAP_INT_GROUP;\
+    uint32_t last = g * HMAP_INT_GROUP + (h->counts[g] & HMAP_INT_COUNT_MASK) - 1;\
+    h->keys[slot] = h->keys[last];\
+    h->values[slot] = h->values[last];\
+    h->counts[g]--;\
+    h->len--;\
+    return true;\
+}\
+\
+void hmap_##K##_##V##_destroy(hmap_##K##_##V *h)\
+{\
+    if (h->value_destructor != NULL) {\
+        HMAP_INT_ITER_BEGIN(h, i)\
+            h->value_destructor(&h->values[i]);\
+        HMAP_INT_ITER_END\
+    }\
+    free(h->counts);\
+    free(h->keys);\
+    free(h->values);\
+}
@@ -0,0 +1,302 @@
+/*
+ * Compact snapshots of the integer hashmaps of hmap_int.h.
+ * The keys are sorted and cut into blocks of HMAP_INT_SNAPSHOT_BLOCK entries. A block stores its first key, then the
+ * differences between consecutive keys bit-packed at the width of the largest one, then the values as a parallel
+ * column bit-packed at the width of the largest value. Dense or clustered keys and small values take a few bits
+ * each instead of sizeof(K) + sizeof(V) bytes. Reading unpacks a whole block with branch-free loops, then inserts it
+ * into a table presized for the whole snapshot, without looking for the keys.
+ * Keys and values are packed as their uint64_t conversions, so negative values take the full 64 bits.
+ * Usage
+ * =====
+ * HMAP_DECLARE_INT_SNAPSHOT(K, V)
+ *     Declares the functions for hmap_K_V, which must have been declared with HMAP_DECLARE_INT(K, V).
+ *     V must be an integer type too.
+ * HMAP_DEFINE_INT_SNAPSHOT(K, V)
+ *     Defines the functions. Has to follow HMAP_DEFINE_INT(K, V) in the same translation unit.
+ *
+ * Functions
+ * =========
+ * int hmap_K_V_snapshot_write(const hmap_K_V *h, int fd):
+ *     Writes the map to fd. Returns 0, or -1 with errno set.
+ *
+ * int hmap_K_V_snapshot_read(hmap_K_V *h, int fd):
+ *     Reads a snapshot from fd into h, which must be initialised and empty. Returns 0, or -1 with errno set; errno
+ *     is EINVAL if the snapshot was written for other types, and EIO if it is truncated or malformed, in which case
+ *     h holds the entries read so far.
+ *
+ * Example
+ * =======
+ * HMAP_DECLARE_INT(uint64_t, uint32_t)
+ * HMAP_DECLARE_INT_SNAPSHOT(uint64_t, uint32_t)
+ * HMAP_DEFINE_INT(uint64_t, uint32_t)
+ * HMAP_DEFINE_INT_SNAPSHOT(uint64_t, uint32_t)
+ *
+ * int fd = open("map.snap", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+ * hmap_uint64_t_uint32_t_snapshot_write(&h, fd);
+ * close(fd);
+ * fd = open("map.snap", O_RDONLY);
+ * hmap_uint64_t_uint32_t_init(&copy, NULL);
+ * hmap_uint64_t_uint32_t_snapshot_read(&copy, fd);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "hmap_int.h"
+
+#define HMAP_INT_SNAPSHOT_MAGIC  0x50414e53544e494dull
+#define HMAP_INT_SNAPSHOT_BLOCK  128
+#define HMAP_INT_SNAPSHOT_BUFFER (1u << 20)
+/* first key, key bits, value bits, entry count, then both columns at up to 64 bits, and slack for 8 byte accesses */
+#define HMAP_INT_SNAPSHOT_BLOCK_MAX (8 + 1 + 1 + 2 + 2 * HMAP_INT_SNAPSHOT_BLOCK * 8 + 16)
+
+typedef struct hmap_int_snapshot_header {
+    uint64_t magic;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint64_t len;
+} hmap_int_snapshot_header;
+
+typedef struct hmap_int_snapshot_pair {
+    uint64_t key;
+    uint64_t value;
+} hmap_int_snapshot_pair;
+
+static inline uint64_t hmap_int_snapshot_load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void hmap_int_snapshot_store64(uint8_t *p, uint64_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t hmap_int_snapshot_bits(uint64_t v)
+{
+    return v != 0 ? 64 - __builtin_clzll(v) : 0;
+}
+
+/* ORs the n values of in, bits wide each, into the zeroed out; returns the bytes used */
+static inline size_t hmap_int_snapshot_pack(uint8_t *out, const uint64_t *in, uint32_t n, uint32_t bits)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t bit = (uint64_t)i * bits;
+        uint8_t *p = out + bit / 8;
+        hmap_int_snapshot_store64(p, hmap_int_snapshot_load64(p) | in[i] << (bit % 8));
+        if (bit % 8 + bits > 64)
+            p[8] |= in[i] >> (64 - bit % 8);
+    }
+    return ((uint64_t)n * bits + 7) / 8;
+}
+
+/* reads up to 8 bytes past the packed values */
+static inline size_t hmap_int_snapshot_unpack(uint64_t *out, const uint8_t *in, uint32_t n, uint32_t bits)
+{
+    uint64_t mask = bits == 64 ? UINT64_MAX : (1ull << bits) - 1;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t bit = (uint64_t)i * bits;
+        uint64_t v = hmap_int_snapshot_load64(in + bit / 8) >> (bit % 8);
+        if (bit % 8 + bits > 64)
+            v |= (uint64_t)in[bit / 8 + 8] << (64 - bit % 8);
+        out[i] = v & mask;
+    }
+    return ((uint64_t)n * bits + 7) / 8;
+}
+
+/* sorts by key, a byte at a time from the lowest, skipping the bytes all keys share; returns the sorted array, which
+ * is either pairs or a new one, and frees the other */
+static inline hmap_int_snapshot_pair *hmap_int_snapshot_sort(hmap_int_snapshot_pair *pairs, size_t n)
+{
+    hmap_int_snapshot_pair *tmp = malloc(n * sizeof(*tmp));
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < n; i++)
+            counts[(pairs[i].key >> shift) & 0xff]++;
+        if (n == 0 || counts[(pairs[0].key >> shift) & 0xff] == n)
+            continue;
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = counts[b];
+            counts[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            tmp[counts[(pairs[i].key >> shift) & 0xff]++] = pairs[i];
+        hmap_int_snapshot_pair *swap = pairs;
+        pairs = tmp;
+        tmp = swap;
+    }
+    free(tmp);
+    return pairs;
+}
+
+static inline int hmap_int_snapshot_write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* refills buf so that at least want bytes from pos are available, if the file has them; returns how many there are */
+static inline size_t hmap_int_snapshot_fill(int fd, uint8_t *buf, size_t *pos, size_t *len, size_t want)
+{
+    if (*len - *pos >= want)
+        return *len - *pos;
+    memmove(buf, buf + *pos, *len - *pos);
+    *len -= *pos;
+    *pos = 0;
+    while (*len < want) {
+        ssize_t n = read(fd, buf + *len, HMAP_INT_SNAPSHOT_BUFFER - *len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        *len += n;
+    }
+    return *len;
+}
+
+#define HMAP_DECLARE_INT_SNAPSHOT(K, V) \
+int hmap_##K##_##V##_snapshot_write(const hmap_##K##_##V *h, int fd);\
+int hmap_##K##_##V##_snapshot_read(hmap_##K##_##V *h, int fd);
+
+#define HMAP_DEFINE_INT_SNAPSHOT(K, V)\
+int hmap_##K##_##V##_snapshot_write(const hmap_##K##_##V *h, int fd)\
+{\
+    hmap_int_snapshot_pair *pairs = malloc(((size_t)h->len + 1) * sizeof(*pairs));\
+    size_t n = 0;\
+    HMAP_INT_ITER_BEGIN(h, i)\
+        pairs[n++] = (hmap_int_snapshot_pair){(uint64_t)h->keys[i], (uint64_t)h->values[i]};\
+    HMAP_INT_ITER_END\
+    pairs = hmap_int_snapshot_sort(pairs, n);\
+\
+    uint8_t *buf = calloc(HMAP_INT_SNAPSHOT_BUFFER + HMAP_INT_SNAPSHOT_BLOCK_MAX, 1);\
+    hmap_int_snapshot_header hdr = {HMAP_INT_SNAPSHOT_MAGIC, sizeof(K), sizeof(V), n};\
+    memcpy(buf, &hdr, sizeof(hdr));\
+    size_t len = sizeof(hdr);\
+    int ret = 0;\
+    uint64_t deltas[HMAP_INT_SNAPSHOT_BLOCK], values[HMAP_INT_SNAPSHOT_BLOCK];\
+    for (size_t start = 0; start < n && ret == 0; start += HMAP_INT_SNAPSHOT_BLOCK) {\
+        uint32_t count = n - start < HMAP_INT_SNAPSHOT_BLOCK ? n - start : HMAP_INT_SNAPSHOT_BLOCK;\
+        uint64_t key_max = 0, value_max = 0;\
+        for (uint32_t i = 0; i < count; i++) {\
+            deltas[i] = i + 1 < count ? pairs[start + i + 1].key - pairs[start + i].key : 0;\
+            values[i] = pairs[start + i].value;\
+            key_max |= deltas[i];\
+            value_max |= values[i];\
+        }\
+        uint32_t key_bits = hmap_int_snapshot_bits(key_max);\
+        uint32_t value_bits = hmap_int_snapshot_bits(value_max);\
+        uint8_t *p = buf + len;\
+        hmap_int_snapshot_store64(p, pairs[start].key);\
+        p[8] = key_bits;\
+        p[9] = value_bits;\
+        p[10] = count & 0xff;\
+        p[11] = count >> 8;\
+        p += 12;\
+        p += hmap_int_snapshot_pack(p, deltas, count - 1, key_bits);\
+        p += hmap_int_snapshot_pack(p, values, count, value_bits);\
+        len = p - buf;\
+        if (len >= HMAP_INT_SNAPSHOT_BUFFER) {\
+            ret = hmap_int_snapshot_write_all(fd, buf, len);\
+            memset(buf, 0, len + 16);\
+            len = 0;\
+        }\
+    }\
+    if (ret == 0)\
+        ret = hmap_int_snapshot_write_all(fd, buf, len);\
+    free(buf);\
+    free(pairs);\
+    return ret;\
+}\
+\
+int hmap_##K##_##V##_snapshot_read(hmap_##K##_##V *h, int fd)\
+{\
+    /* unpacking reads up to 8 bytes past the data */\
+    uint8_t *buf = malloc(HMAP_INT_SNAPSHOT_BUFFER + 8);\
+    size_t pos = 0, len = 0;\
+    hmap_int_snapshot_header hdr;\
+    int err = 0;\
+    if (hmap_int_snapshot_fill(fd, buf, &pos, &len, sizeof(hdr)) < sizeof(hdr)) {\
+        err = EIO;\
+        goto done;\
+    }\
+    memcpy(&hdr, buf, sizeof(hdr));\
+    pos = sizeof(hdr);\
+    if (hdr.magic != HMAP_INT_SNAPSHOT_MAGIC || hdr.key_size != sizeof(K) || hdr.value_size != sizeof(V)) {\
+        err = EINVAL;\
+        goto done;\
+    }\
+    /* the largest table has 2^31 slots, and the entries have to stay under its load factor */\
+    if (hdr.len >= h->load_factor * 0x80000000u - h->len) {\
+        err = EIO;\
+        goto done;\
+    }\
+    uint32_t cap = h->cap;\
+    while (cap < 0x80000000u && cap * h->load_factor <= h->len + hdr.len)\
+        cap <<= 1;\
+    if (cap != h->cap)\
+        hmap_##K##_##V##_rehash(h, cap);\
+\
+    uint64_t keys[HMAP_INT_SNAPSHOT_BLOCK], values[HMAP_INT_SNAPSHOT_BLOCK];\
+    for (uint64_t done = 0; done < hdr.len; ) {\
+        size_t avail = hmap_int_snapshot_fill(fd, buf, &pos, &len, HMAP_INT_SNAPSHOT_BLOCK_MAX);\
+        const uint8_t *p = buf + pos;\
+        if (avail < 12) {\
+            err = EIO;\
+            goto done;\
+        }\
+        uint32_t key_bits = p[8], value_bits = p[9], count = p[10] | p[11] << 8;\
+        size_t size = 12 + ((uint64_t)(count - 1) * key_bits + 7) / 8 + ((uint64_t)count * value_bits + 7) / 8;\
+        if (key_bits > 64 || value_bits > 64 || count == 0 || count > HMAP_INT_SNAPSHOT_BLOCK || count > hdr.len - done || avail < size) {\
+            err = EIO;\
+            goto done;\
+        }\
+        memset(buf + len, 0, 8);\
+        keys[0] = hmap_int_snapshot_load64(p);\
+        p += 12;\
+        p += hmap_int_snapshot_unpack(keys + 1, p, count - 1, key_bits);\
+        hmap_int_snapshot_unpack(values, p, count, value_bits);\
+        for (uint32_t i = 1; i < count; i++)\
+            keys[i] += keys[i - 1];\
+        for (uint32_t i = 0; i < count; i++) {\
+            uint32_t g = hmap_##K##_##V##_group(h, (K)keys[i]);\
+            __builtin_prefetch(&h->counts[g], 1);\
+            __builtin_prefetch(&h->keys[g * HMAP_INT_GROUP], 1);\
+        }\
+        for (uint32_t i = 0; i < count; i++) {\
+            uint32_t slot = hmap_##K##_##V##_insert_new(h, (K)keys[i]);\
+            h->values[slot] = (V)values[i];\
+        }\
+        h->len += count;\
+        done += count;\
+        pos += size;\
+    }\
+done:\
+    free(buf);\
+    errno = err;\
+    return err ? -1 : 0;\
+}
@@ -0,0 +1,452 @@
+/*
+ * Streams a file of records into a hashmap, overlapping the reads with parsing and putting.
+ * The file is read in chunks of chunk_size bytes into depth buffers, and the reads of the following chunks are kept
+ * in flight while the calling thread parses the current one, so the map is built at the speed of the slower of the
+ * disk and the parser. Reads are submitted with io_uring through its raw system calls, or, when the kernel refuses
+ * io_uring, issued by one pread thread per buffer.
+ * The parser is called on every chunk in order and puts the records it finds into its map. It returns how many
+ * bytes it consumed; the rest, an incomplete record, is passed again at the start of the next call.
+ * The file has to support reads at an offset, as regular files and block devices do.
+ *
+ * Functions
+ * =========
+ * int hmap_load(int fd, size_t (*parse)(const char *data, size_t len, bool eof, void *ctx), void *ctx, size_t chunk_size, uint32_t depth):
+ *     Reads fd from offset 0 to its end, passing the data to parse. eof is true on the last call, which has to consume
+ *     everything. parse can return HMAP_LOAD_ABORT to stop. chunk_size and depth can be 0 for HMAP_LOAD_CHUNK and
+ *     HMAP_LOAD_DEPTH. Returns 0, or -1 with errno set; errno is ECANCELED if parse aborted, and EIO if it left
+ *     bytes at the end of the file.
+ *
+ * Example
+ * =======
+ * // fixed size records of a uint64_t key and a uint32_t value
+ * size_t parse(const char *data, size_t len, bool eof, void *ctx)
+ * {
+ *     size_t n = len / 12;
+ *     for (size_t i = 0; i < n; i++) {
+ *         uint64_t key;
+ *         memcpy(&key, data + 12 * i, 8);
+ *         memcpy(hmap_uint64_t_uint32_t_put(ctx, key), data + 12 * i + 8, 4);
+ *     }
+ *     return 12 * n;
+ * }
+ *
+ * hmap_load(fd, parse, &h, 0, 0);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HMAP_LOAD_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define HMAP_LOAD_CHUNK    (4u << 20)
+#define HMAP_LOAD_DEPTH    8
+/* room in front of every buffer for the incomplete record of the previous chunk; longer ones are copied */
+#define HMAP_LOAD_HEADROOM (64u << 10)
+#define HMAP_LOAD_ABORT    SIZE_MAX
+
+enum { HMAP_LOAD_IDLE, HMAP_LOAD_PENDING, HMAP_LOAD_DONE };
+
+#ifdef HMAP_LOAD_URING
+typedef struct hmap_load_uring {
+    int                 fd;
+    bool                broken;
+    uint32_t            entries;
+    uint32_t            inflight;
+    void                *sq;
+    void                *cq;
+    size_t              sq_size;
+    size_t              cq_size;
+    uint32_t            *sq_tail;
+    uint32_t            *sq_mask;
+    uint32_t            *sq_array;
+    uint32_t            *cq_head;
+    uint32_t            *cq_tail;
+    uint32_t            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} hmap_load_uring;
+#endif
+
+typedef struct hmap_load_reader hmap_load_reader;
+
+typedef struct hmap_load_worker {
+    hmap_load_reader *r;
+    uint32_t         slot;
+} hmap_load_worker;
+
+/* depth slots, each with a buffer and the read it is waiting for */
+typedef struct hmap_load_reader {
+    int              fd;
+    size_t           chunk_size;
+    uint32_t         depth;
+    char             **bufs;
+    uint64_t         *offs;
+    size_t           *want;
+    /* bytes read, or -errno */
+    ssize_t          *got;
+    int              *state;
+    bool             uring;
+#ifdef HMAP_LOAD_URING
+    hmap_load_uring  ring;
+#endif
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    bool             stop;
+    pthread_t        *tids;
+    bool             *started;
+    hmap_load_worker *workers;
+} hmap_load_reader;
+
+/* reads len bytes at off, or fewer at the end of the file; returns the bytes read, or -errno */
+static inline ssize_t hmap_load_pread(int fd, char *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+#ifdef HMAP_LOAD_URING
+static inline int hmap_load_uring_enter(hmap_load_uring *u, uint32_t submit, uint32_t wait)
+{
+    for (;;) {
+        long ret = syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0 || errno != EINTR)
+            return ret < 0 ? -1 : 0;
+    }
+}
+
+static inline void hmap_load_uring_destroy(hmap_load_uring *u)
+{
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+    if (u->cq != NULL && u->cq != MAP_FAILED && u->cq != u->sq)
+        munmap(u->cq, u->cq_size);
+    if (u->sq != NULL && u->sq != MAP_FAILED)
+        munmap(u->sq, u->sq_size);
+    close(u->fd);
+}
+
+static inline int hmap_load_uring_init(hmap_load_uring *u, uint32_t entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+    u->entries = p.sq_entries;
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        u->sq_size = u->cq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+    u->sq = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq = single ? u->sq : mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq == MAP_FAILED || u->cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+        hmap_load_uring_destroy(u);
+        return -1;
+    }
+    u->sq_tail = (uint32_t *)((char *)u->sq + p.sq_off.tail);
+    u->sq_mask = (uint32_t *)((char *)u->sq + p.sq_off.ring_mask);
+    u->sq_array = (uint32_t *)((char *)u->sq + p.sq_off.array);
+    u->cq_head = (uint32_t *)((char *)u->cq + p.cq_off.head);
+    u->cq_tail = (uint32_t *)((char *)u->cq + p.cq_off.tail);
+    u->cq_mask = (uint32_t *)((char *)u->cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* moves the completions into the slots */
+static inline void hmap_load_uring_reap(hmap_load_reader *r)
+{
+    hmap_load_uring *u = &r->ring;
+    uint32_t head = *u->cq_head;
+    uint32_t tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        r->got[cqe->user_data] = cqe->res;
+        r->state[cqe->user_data] = HMAP_LOAD_DONE;
+        u->inflight--;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+static inline void *hmap_load_thread(void *arg)
+{
+    hmap_load_worker *w = arg;
+    hmap_load_reader *r = w->r;
+    uint32_t s = w->slot;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->state[s] != HMAP_LOAD_PENDING && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->state[s] != HMAP_LOAD_PENDING)
+            break;
+        pthread_mutex_unlock(&r->lock);
+        ssize_t got = hmap_load_pread(r->fd, r->bufs[s] + HMAP_LOAD_HEADROOM, r->want[s], r->offs[s]);
+        pthread_mutex_lock(&r->lock);
+        r->got[s] = got;
+        r->state[s] = HMAP_LOAD_DONE;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static inline void hmap_load_reader_init(hmap_load_reader *r, int fd, size_t chunk_size, uint32_t depth)
+{
+    r->fd = fd;
+    r->chunk_size = chunk_size;
+    r->depth = depth;
+    r->bufs = malloc(depth * sizeof(*r->bufs));
+    for (uint32_t s = 0; s < depth; s++)
+        r->bufs[s] = malloc(HMAP_LOAD_HEADROOM + chunk_size);
+    r->offs = malloc(depth * sizeof(*r->offs));
+    r->want = malloc(depth * sizeof(*r->want));
+    r->got = malloc(depth * sizeof(*r->got));
+    r->state = calloc(depth, sizeof(*r->state));
+    r->stop = false;
+    r->tids = NULL;
+    r->started = NULL;
+    r->workers = NULL;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+#ifdef HMAP_LOAD_URING
+    r->uring = hmap_load_uring_init(&r->ring, depth) == 0;
+    if (r->uring)
+        return;
+#else
+    r->uring = false;
+#endif
+    r->tids = malloc(depth * sizeof(*r->tids));
+    r->started = malloc(depth * sizeof(*r->started));
+    r->workers = malloc(depth * sizeof(*r->workers));
+    for (uint32_t s = 0; s < depth; s++) {
+        r->workers[s] = (hmap_load_worker){r, s};
+        r->started[s] = pthread_create(&r->tids[s], NULL, hmap_load_thread, &r->workers[s]) == 0;
+    }
+}
+
+/* starts reading len bytes at off into slot s */
+static inline void hmap_load_submit(hmap_load_reader *r, uint32_t s, uint64_t off, size_t len)
+{
+    r->offs[s] = off;
+    r->want[s] = len;
+#ifdef HMAP_LOAD_URING
+    hmap_load_uring *u = &r->ring;
+    if (r->uring && !u->broken) {
+        uint32_t tail = *u->sq_tail;
+        uint32_t index = tail & *u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = r->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(r->bufs[s] + HMAP_LOAD_HEADROOM);
+        sqe->len = len;
+        sqe->off = off;
+        sqe->user_data = s;
+        u->sq_array[index] = index;
+        __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        r->state[s] = HMAP_LOAD_PENDING;
+        if (hmap_load_uring_enter(u, 1, 0) == 0) {
+            u->inflight++;
+            return;
+        }
+        /* the entry stays unsubmitted, as the ring is never entered again */
+        u->broken = true;
+    }
+    if (r->uring) {
+        r->got[s] = hmap_load_pread(r->fd, r->bufs[s] + HMAP_LOAD_HEADROOM, len, off);
+        r->state[s] = HMAP_LOAD_DONE;
+        return;
+    }
+#endif
+    if (!r->started[s]) {
+        r->got[s] = hmap_load_pread(r->fd, r->bufs[s] + HMAP_LOAD_HEADROOM, len, off);
+        r->state[s] = HMAP_LOAD_DONE;
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    r->state[s] = HMAP_LOAD_PENDING;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* waits for the read of slot s, and returns the bytes read, or -errno */
+static inline ssize_t hmap_load_wait(hmap_load_reader *r, uint32_t s)
+{
+#ifdef HMAP_LOAD_URING
+    if (r->uring) {
+        while (r->state[s] != HMAP_LOAD_DONE) {
+            hmap_load_uring_reap(r);
+            if (r->state[s] != HMAP_LOAD_DONE && hmap_load_uring_enter(&r->ring, 0, 1) != 0)
+                return -errno;
+        }
+        r->state[s] = HMAP_LOAD_IDLE;
+    } else
+#endif
+    {
+        pthread_mutex_lock(&r->lock);
+        while (r->state[s] != HMAP_LOAD_DONE)
+            pthread_cond_wait(&r->cond, &r->lock);
+        r->state[s] = HMAP_LOAD_IDLE;
+        pthread_mutex_unlock(&r->lock);
+    }
+    ssize_t got = r->got[s];
+    /* io_uring can complete a read short, or reject the operation on kernels without IORING_OP_READ */
+    if (got >= 0 && (size_t)got < r->want[s]) {
+        ssize_t rest = hmap_load_pread(r->fd, r->bufs[s] + HMAP_LOAD_HEADROOM + got, r->want[s] - got, r->offs[s] + got);
+        got = rest < 0 ? rest : got + rest;
+    } else if (got == -EINVAL || got == -EOPNOTSUPP) {
+        got = hmap_load_pread(r->fd, r->bufs[s] + HMAP_LOAD_HEADROOM, r->want[s], r->offs[s]);
+    }
+    return got;
+}
+
+static inline void hmap_load_reader_destroy(hmap_load_reader *r)
+{
+#ifdef HMAP_LOAD_URING
+    if (r->uring) {
+        /* the kernel may still be writing into the buffers */
+        while (r->ring.inflight > 0) {
+            hmap_load_uring_reap(r);
+            if (r->ring.inflight > 0 && hmap_load_uring_enter(&r->ring, 0, 1) != 0)
+                break;
+        }
+        hmap_load_uring_destroy(&r->ring);
+    }
+#endif
+    if (!r->uring) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        for (uint32_t s = 0; s < r->depth; s++)
+            if (r->started[s])
+                pthread_join(r->tids[s], NULL);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    for (uint32_t s = 0; s < r->depth; s++)
+        free(r->bufs[s]);
+    free(r->bufs);
+    free(r->offs);
+    free(r->want);
+    free(r->got);
+    free(r->state);
+    free(r->tids);
+    free(r->started);
+    free(r->workers);
+}
+
+static inline int hmap_load(int fd, size_t (*parse)(const char *data, size_t len, bool eof, void *ctx), void *ctx, size_t chunk_size, uint32_t depth)
+{
+    if (chunk_size == 0)
+        chunk_size = HMAP_LOAD_CHUNK;
+    if (depth == 0)
+        depth = HMAP_LOAD_DEPTH;
+    struct stat st;
+    uint64_t size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (uint64_t)st.st_size : UINT64_MAX;
+    if (size == 0) {
+        size_t used = parse("", 0, true, ctx);
+        if (used == 0)
+            return 0;
+        errno = used == HMAP_LOAD_ABORT ? ECANCELED : EIO;
+        return -1;
+    }
+
+    hmap_load_reader r;
+    hmap_load_reader_init(&r, fd, chunk_size, depth);
+    uint64_t next = 0;
+    for (uint32_t s = 0; s < depth && next < size; s++, next += chunk_size)
+        hmap_load_submit(&r, s, next, size - next < chunk_size ? size - next : chunk_size);
+
+    char *carry = NULL, *joined = NULL;
+    size_t carry_len = 0;
+    int err = 0;
+    for (uint64_t i = 0;; i++) {
+        uint32_t s = i % depth;
+        ssize_t n = hmap_load_wait(&r, s);
+        if (n < 0) {
+            err = -n;
+            break;
+        }
+        bool eof = (size_t)n < chunk_size || i * chunk_size + n >= size;
+        char *data = r.bufs[s] + HMAP_LOAD_HEADROOM;
+        size_t len = n;
+        if (carry_len > 0 && carry_len <= HMAP_LOAD_HEADROOM) {
+            data -= carry_len;
+            memcpy(data, carry, carry_len);
+        } else if (carry_len > 0) {
+            char *grown = realloc(joined, carry_len + n);
+            if (grown == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            joined = grown;
+            memcpy(joined, carry, carry_len);
+            memcpy(joined + carry_len, data, n);
+            data = joined;
+        }
+        len += carry_len;
+        size_t used = parse(data, len, eof, ctx);
+        if (used == HMAP_LOAD_ABORT) {
+            err = ECANCELED;
+            break;
+        }
+        if (used > len || (eof && used < len)) {
+            err = EIO;
+            break;
+        }
+        if (eof)
+            break;
+        /* the slot is about to be reused, so the incomplete record moves out first */
+        if (len - used > carry_len) {
+            char *grown = realloc(carry, len - used);
+            if (grown == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            carry = grown;
+        }
+        carry_len = len - used;
+        if (carry_len > 0)
+            memmove(carry, data + used, carry_len);
+        if (next < size) {
+            hmap_load_submit(&r, s, next, size - next < chunk_size ? size - next : chunk_size);
+            next += chunk_size;
+        }
+    }
+    free(carry);
+    free(joined);
+    hmap_load_reader_destroy(&r);
+    errno = err;
+    return err ? -1 : 0;
+}
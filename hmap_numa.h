@@ -0,0 +1,479 @@
+/*
+ * Implements a generic hashmap sharded over NUMA nodes, for maps used by threads on several sockets.
+ * Every shard has its own read-write lock and table, and its memory (the shard itself, its bucket array and slabs of
+ * entries) is mmap'd and bound to its node with mbind before being touched, so it stays there whichever thread
+ * inserts. Placement is best effort: without NUMA support, mbind fails and pages come from the node touching them.
+ * A key is normally kept by its owner shard, picked by its hash, so any thread finds it. A thread can also use the
+ * shards of its own node directly, for data only that node needs, e.g. a per node cache; keys put there are only
+ * found through those shards. Every shard counts the accesses from threads on its node and from other nodes.
+ * Keys and values are copied bitwise. No libnuma is needed, only the getcpu and mbind system calls.
+ * Usage
+ * =====
+ * HMAP_NUMA_DECLARE(K, V)
+ *     Defines structures hmap_numa_K_V, hmap_numa_K_V_shard and hmap_numa_K_V_entry, and declares the functions.
+ *     If K or V is a pointer, then it has to be typedef'd.
+ * HMAP_NUMA_DEFINE(K, V, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ *
+ * Functions
+ * =========
+ * uint32_t hmap_numa_nodes(void):
+ *     Returns the number of NUMA nodes of the machine, 1 if it is not NUMA.
+ *
+ * uint32_t hmap_numa_node(uint32_t *cpu):
+ *     Returns the node of the calling thread, and stores its cpu into cpu if it is not NULL. The result is cached for
+ *     HMAP_NUMA_NODE_REFRESH calls, so it can be behind for a while after the thread migrates.
+ *
+ * int hmap_numa_K_V_init(hmap_numa_K_V *h, uint32_t nodes, uint32_t shards_per_node, float load_factor, uint32_t initial_capacity):
+ *     Creates shards_per_node shards on each of nodes nodes, or of hmap_numa_nodes() if nodes is 0. Shard i is on
+ *     node i % nodes. Every shard starts with initial_capacity buckets, rounded to next power of 2.
+ *     Returns 0, or -1 with errno set.
+ *
+ * void hmap_numa_K_V_destroy(hmap_numa_K_V *h):
+ *     Unmaps the memory of every shard.
+ *
+ * bool hmap_numa_K_V_put(hmap_numa_K_V *h, const K *key, const V *value):
+ *     Puts the key with the value into its owner shard. Returns false if memory is exhausted.
+ *
+ * bool hmap_numa_K_V_get(hmap_numa_K_V *h, const K *key, V *value):
+ *     Copies the value associated with the key in its owner shard into value. Returns false if it doesn't exist.
+ *
+ * bool hmap_numa_K_V_remove(hmap_numa_K_V *h, const K *key):
+ *     Removes the key from its owner shard. Returns true if removed, false if it doesn't exist.
+ *
+ * hmap_numa_K_V_shard *hmap_numa_K_V_owner(hmap_numa_K_V *h, const K *key):
+ *     Returns the owner shard of the key. shard->node tells where it lives, e.g. to hand the work to a thread there.
+ *
+ * hmap_numa_K_V_shard *hmap_numa_K_V_local(hmap_numa_K_V *h):
+ *     Returns a shard on the node of the calling thread, picked by its cpu among the shards of that node.
+ *
+ * bool hmap_numa_K_V_shard_put(hmap_numa_K_V_shard *s, const K *key, const V *value):
+ * bool hmap_numa_K_V_shard_get(hmap_numa_K_V_shard *s, const K *key, V *value):
+ * bool hmap_numa_K_V_shard_remove(hmap_numa_K_V_shard *s, const K *key):
+ *     As put, get and remove, on the shard s.
+ *
+ * void hmap_numa_K_V_for_each(hmap_numa_K_V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx):
+ *     Calls fn on every key and value, holding the read lock of one shard at a time. fn must not use the map.
+ *
+ * uint32_t hmap_numa_K_V_len(hmap_numa_K_V *h):
+ *     Returns the number of entries of all shards.
+ *
+ * void hmap_numa_K_V_stats(hmap_numa_K_V *h, uint64_t *local, uint64_t *remote):
+ *     Stores how many shard accesses came from threads on the node of the shard, and from other nodes.
+ *
+ * Example
+ * =======
+ * HMAP_NUMA_DECLARE(int, int)
+ * HMAP_NUMA_DEFINE(int, int, hash_func, eq_func)
+ *
+ * hmap_numa_int_int h;
+ * hmap_numa_int_int_init(&h, 0, 4, HMAP_DEFAULT_LOAD_FACTOR, HMAP_DEFAULT_INITIAL_CAPACITY);
+ * // from any thread
+ * hmap_numa_int_int_put(&h, &(int){1}, &(int){2});
+ * int v;
+ * hmap_numa_int_int_get(&h, &(int){1}, &v); // 2
+ * hmap_numa_int_int_shard_put(hmap_numa_int_int_local(&h), &(int){1}, &(int){3}); // this node's own copy
+ * uint64_t local, remote;
+ * hmap_numa_int_int_stats(&h, &local, &remote);
+ * hmap_numa_int_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "hmap.h"
+
+#define HMAP_NUMA_MAX_NODES    128
+#define HMAP_NUMA_NODE_REFRESH 1024
+#ifndef HMAP_NUMA_SLAB_SIZE
+#define HMAP_NUMA_SLAB_SIZE    (256u << 10)
+#endif
+/* slabs start with a pointer to the previous one, padded so entries stay aligned */
+#define HMAP_NUMA_SLAB_HEADER  _Alignof(max_align_t)
+/* from linux/mempolicy.h */
+#define HMAP_NUMA_MPOL_PREFERRED 1
+
+static inline uint32_t hmap_numa_nodes(void)
+{
+    /* e.g. "0-1" or "0,2-3"; the highest node gives the count */
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd < 0)
+        return 1;
+    char buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+    uint32_t max = 0, v = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            v = v * 10 + (buf[i] - '0');
+            if (v > max)
+                max = v;
+        } else {
+            v = 0;
+        }
+    }
+    return max < HMAP_NUMA_MAX_NODES ? max + 1 : HMAP_NUMA_MAX_NODES;
+}
+
+static inline uint32_t hmap_numa_node(uint32_t *cpu)
+{
+    static __thread uint32_t cached_cpu, cached_node, calls;
+    if (calls++ % HMAP_NUMA_NODE_REFRESH == 0) {
+        unsigned c, n;
+        if (syscall(SYS_getcpu, &c, &n, NULL) == 0) {
+            cached_cpu = c;
+            cached_node = n;
+        }
+    }
+    if (cpu != NULL)
+        *cpu = cached_cpu;
+    return cached_node;
+}
+
+/* maps size zeroed bytes, whose pages are allocated on node when they are first touched */
+static inline void *hmap_numa_alloc(size_t size, uint32_t node)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef SYS_mbind
+    const uint32_t bits = 8 * sizeof(unsigned long);
+    unsigned long mask[HMAP_NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / bits] = 1ul << (node % bits);
+    /* preferred rather than bound, so a full node falls back to another one instead of failing */
+    syscall(SYS_mbind, p, size, HMAP_NUMA_MPOL_PREFERRED, mask, HMAP_NUMA_MAX_NODES + 1, 0);
+#endif
+#ifdef MADV_HUGEPAGE
+    if (size >= HMAP_MMAP_THRESHOLD)
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static inline void hmap_numa_free(void *p, size_t size)
+{
+    if (p != NULL)
+        munmap(p, size);
+}
+
+#define HMAP_NUMA_DECLARE(K, V) \
+typedef struct hmap_numa_##K##_##V##_entry hmap_numa_##K##_##V##_entry;\
+typedef struct hmap_numa_##K##_##V##_entry {\
+    uint32_t                    hash;\
+    K                           key;\
+    V                           value;\
+    hmap_numa_##K##_##V##_entry *next;\
+} hmap_numa_##K##_##V##_entry;\
+\
+typedef struct hmap_numa_##K##_##V##_shard {\
+    pthread_rwlock_t            lock;\
+    uint32_t                    node;\
+    uint32_t                    len;\
+    uint32_t                    cap;\
+    float                       load_factor;\
+    uint32_t                    threshold;\
+    hmap_numa_##K##_##V##_entry **buckets;\
+    hmap_numa_##K##_##V##_entry *free_list;\
+    /* the slab entries are carved from, and how much of it is used */\
+    char                        *slab;\
+    size_t                      slab_used;\
+    uint64_t                    local;\
+    uint64_t                    remote;\
+} hmap_numa_##K##_##V##_shard;\
+\
+typedef struct hmap_numa_##K##_##V {\
+    uint32_t                    nodes;\
+    uint32_t                    shards_per_node;\
+    uint32_t                    nshards;\
+    hmap_numa_##K##_##V##_shard **shards;\
+} hmap_numa_##K##_##V;\
+\
+int                          hmap_numa_##K##_##V##_init(hmap_numa_##K##_##V *h, uint32_t nodes, uint32_t shards_per_node, float load_factor, uint32_t initial_capacity);\
+void                         hmap_numa_##K##_##V##_destroy(hmap_numa_##K##_##V *h);\
+bool                         hmap_numa_##K##_##V##_put(hmap_numa_##K##_##V *h, const K *key, const V *value);\
+bool                         hmap_numa_##K##_##V##_get(hmap_numa_##K##_##V *h, const K *key, V *value);\
+bool                         hmap_numa_##K##_##V##_remove(hmap_numa_##K##_##V *h, const K *key);\
+hmap_numa_##K##_##V##_shard *hmap_numa_##K##_##V##_owner(hmap_numa_##K##_##V *h, const K *key);\
+hmap_numa_##K##_##V##_shard *hmap_numa_##K##_##V##_local(hmap_numa_##K##_##V *h);\
+bool                         hmap_numa_##K##_##V##_shard_put(hmap_numa_##K##_##V##_shard *s, const K *key, const V *value);\
+bool                         hmap_numa_##K##_##V##_shard_get(hmap_numa_##K##_##V##_shard *s, const K *key, V *value);\
+bool                         hmap_numa_##K##_##V##_shard_remove(hmap_numa_##K##_##V##_shard *s, const K *key);\
+void                         hmap_numa_##K##_##V##_for_each(hmap_numa_##K##_##V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx);\
+uint32_t                     hmap_numa_##K##_##V##_len(hmap_numa_##K##_##V *h);\
+void                         hmap_numa_##K##_##V##_stats(hmap_numa_##K##_##V *h, uint64_t *local, uint64_t *remote);
+
+#define HMAP_NUMA_DEFINE(K, V, hash_func, eq_func)\
+static uint32_t hmap_numa_##K##_##V##_hash(const K *key) \
+{\
+    return hmap_mix(hash_func(key));\
+}\
+\
+static void hmap_numa_##K##_##V##_shard_free(hmap_numa_##K##_##V##_shard *s)\
+{\
+    while (s->slab != NULL) {\
+        char *prev;\
+        memcpy(&prev, s->slab, sizeof(prev));\
+        hmap_numa_free(s->slab, HMAP_NUMA_SLAB_SIZE);\
+        s->slab = prev;\
+    }\
+    hmap_numa_free(s->buckets, s->cap * sizeof(*s->buckets));\
+    pthread_rwlock_destroy(&s->lock);\
+    hmap_numa_free(s, sizeof(*s));\
+}\
+\
+int hmap_numa_##K##_##V##_init(hmap_numa_##K##_##V *h, uint32_t nodes, uint32_t shards_per_node, float load_factor, uint32_t initial_capacity)\
+{\
+    if (nodes == 0)\
+        nodes = hmap_numa_nodes();\
+    if (nodes > HMAP_NUMA_MAX_NODES || shards_per_node == 0) {\
+        errno = EINVAL;\
+        return -1;\
+    }\
+    uint32_t cap = 1;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    h->nodes = nodes;\
+    h->shards_per_node = shards_per_node;\
+    h->nshards = nodes * shards_per_node;\
+    h->shards = calloc(h->nshards, sizeof(*h->shards));\
+    if (h->shards == NULL)\
+        return -1;\
+    for (uint32_t i = 0; i < h->nshards; i++) {\
+        hmap_numa_##K##_##V##_shard *s = hmap_numa_alloc(sizeof(*s), i % nodes);\
+        hmap_numa_##K##_##V##_entry **buckets = hmap_numa_alloc(cap * sizeof(*buckets), i % nodes);\
+        if (s == NULL || buckets == NULL) {\
+            hmap_numa_free(s, sizeof(*s));\
+            hmap_numa_free(buckets, cap * sizeof(*buckets));\
+            hmap_numa_##K##_##V##_destroy(h);\
+            errno = ENOMEM;\
+            return -1;\
+        }\
+        pthread_rwlock_init(&s->lock, NULL);\
+        s->node = i % nodes;\
+        s->cap = cap;\
+        s->load_factor = load_factor;\
+        s->threshold = load_factor * cap;\
+        s->buckets = buckets;\
+        h->shards[i] = s;\
+    }\
+    return 0;\
+}\
+\
+void hmap_numa_##K##_##V##_destroy(hmap_numa_##K##_##V *h)\
+{\
+    for (uint32_t i = 0; i < h->nshards; i++) {\
+        if (h->shards[i] != NULL)\
+            hmap_numa_##K##_##V##_shard_free(h->shards[i]);\
+    }\
+    free(h->shards);\
+}\
+\
+static inline void hmap_numa_##K##_##V##_count(hmap_numa_##K##_##V##_shard *s)\
+{\
+    __atomic_fetch_add(hmap_numa_node(NULL) == s->node ? &s->local : &s->remote, 1, __ATOMIC_RELAXED);\
+}\
+\
+static hmap_numa_##K##_##V##_entry *hmap_numa_##K##_##V##_new_entry(hmap_numa_##K##_##V##_shard *s)\
+{\
+    hmap_numa_##K##_##V##_entry *e = s->free_list;\
+    if (e != NULL) {\
+        s->free_list = e->next;\
+        return e;\
+    }\
+    if (s->slab == NULL || s->slab_used + sizeof(*e) > HMAP_NUMA_SLAB_SIZE) {\
+        char *slab = hmap_numa_alloc(HMAP_NUMA_SLAB_SIZE, s->node);\
+        if (slab == NULL)\
+            return NULL;\
+        memcpy(slab, &s->slab, sizeof(s->slab));\
+        s->slab = slab;\
+        s->slab_used = HMAP_NUMA_SLAB_HEADER;\
+    }\
+    e = (hmap_numa_##K##_##V##_entry *)(s->slab + s->slab_used);\
+    s->slab_used += sizeof(*e);\
+    return e;\
+}\
+\
+static void hmap_numa_##K##_##V##_resize(hmap_numa_##K##_##V##_shard *s)\
+{\
+    uint32_t cap = s->cap << 1;\
+    hmap_numa_##K##_##V##_entry **buckets = hmap_numa_alloc(cap * sizeof(*buckets), s->node);\
+    /* without memory the chains just get longer */\
+    if (buckets == NULL)\
+        return;\
+    for (uint32_t i = 0; i < s->cap; i++) {\
+        hmap_numa_##K##_##V##_entry *e = s->buckets[i];\
+        while (e != NULL) {\
+            hmap_numa_##K##_##V##_entry *next = e->next;\
+            e->next = buckets[e->hash & (cap - 1)];\
+            buckets[e->hash & (cap - 1)] = e;\
+            e = next;\
+        }\
+    }\
+    hmap_numa_free(s->buckets, s->cap * sizeof(*s->buckets));\
+    s->buckets = buckets;\
+    s->cap = cap;\
+    s->threshold = s->load_factor * cap;\
+}\
+\
+static hmap_numa_##K##_##V##_entry **hmap_numa_##K##_##V##_find(hmap_numa_##K##_##V##_shard *s, const K *key, uint32_t hash)\
+{\
+    hmap_numa_##K##_##V##_entry **e = &s->buckets[hash & (s->cap - 1)];\
+    for (; *e != NULL; e = &(*e)->next) {\
+        if ((*e)->hash == hash && eq_func(&(*e)->key, key)) {\
+            break;\
+        }\
+    }\
+    return e;\
+}\
+\
+static bool hmap_numa_##K##_##V##_put_hashed(hmap_numa_##K##_##V##_shard *s, const K *key, uint32_t hash, const V *value)\
+{\
+    bool ok = true;\
+    hmap_numa_##K##_##V##_count(s);\
+    pthread_rwlock_wrlock(&s->lock);\
+    if (s->len >= s->threshold) {\
+        hmap_numa_##K##_##V##_resize(s);\
+    }\
+    hmap_numa_##K##_##V##_entry **e = hmap_numa_##K##_##V##_find(s, key, hash);\
+    if (*e == NULL) {\
+        hmap_numa_##K##_##V##_entry *new_entry = hmap_numa_##K##_##V##_new_entry(s);\
+        if (new_entry != NULL) {\
+            new_entry->hash = hash;\
+            new_entry->key = *key;\
+            new_entry->next = NULL;\
+            *e = new_entry;\
+            __atomic_store_n(&s->len, s->len + 1, __ATOMIC_RELAXED);\
+        }\
+        ok = new_entry != NULL;\
+    }\
+    if (ok)\
+        (*e)->value = *value;\
+    pthread_rwlock_unlock(&s->lock);\
+    return ok;\
+}\
+\
+static bool hmap_numa_##K##_##V##_get_hashed(hmap_numa_##K##_##V##_shard *s, const K *key, uint32_t hash, V *value)\
+{\
+    hmap_numa_##K##_##V##_count(s);\
+    pthread_rwlock_rdlock(&s->lock);\
+    hmap_numa_##K##_##V##_entry *e = *hmap_numa_##K##_##V##_find(s, key, hash);\
+    if (e != NULL)\
+        *value = e->value;\
+    pthread_rwlock_unlock(&s->lock);\
+    return e != NULL;\
+}\
+\
+static bool hmap_numa_##K##_##V##_remove_hashed(hmap_numa_##K##_##V##_shard *s, const K *key, uint32_t hash)\
+{\
+    hmap_numa_##K##_##V##_count(s);\
+    pthread_rwlock_wrlock(&s->lock);\
+    hmap_numa_##K##_##V##_entry **prev_next = hmap_numa_##K##_##V##_find(s, key, hash);\
+    hmap_numa_##K##_##V##_entry *e = *prev_next;\
+    if (e != NULL) {\
+        *prev_next = e->next;\
+        e->next = s->free_list;\
+        s->free_list = e;\
+        __atomic_store_n(&s->len, s->len - 1, __ATOMIC_RELAXED);\
+    }\
+    pthread_rwlock_unlock(&s->lock);\
+    return e != NULL;\
+}\
+\
+/* the mixed hash keeps the top bits of small keys zero, so they are spread by a fibonacci multiply first */\
+static inline hmap_numa_##K##_##V##_shard *hmap_numa_##K##_##V##_owner_of(hmap_numa_##K##_##V *h, uint32_t hash)\
+{\
+    return h->shards[((uint64_t)(uint32_t)(hash * 0x9e3779b9u) * h->nshards) >> 32];\
+}\
+\
+hmap_numa_##K##_##V##_shard *hmap_numa_##K##_##V##_owner(hmap_numa_##K##_##V *h, const K *key)\
+{\
+    return hmap_numa_##K##_##V##_owner_of(h, hmap_numa_##K##_##V##_hash(key));\
+}\
+\
+hmap_numa_##K##_##V##_shard *hmap_numa_##K##_##V##_local(hmap_numa_##K##_##V *h)\
+{\
+    uint32_t cpu;\
+    uint32_t node = hmap_numa_node(&cpu) % h->nodes;\
+    return h->shards[node + h->nodes * (cpu % h->shards_per_node)];\
+}\
+\
+bool hmap_numa_##K##_##V##_put(hmap_numa_##K##_##V *h, const K *key, const V *value)\
+{\
+    uint32_t hash = hmap_numa_##K##_##V##_hash(key);\
+    return hmap_numa_##K##_##V##_put_hashed(hmap_numa_##K##_##V##_owner_of(h, hash), key, hash, value);\
+}\
+\
+bool hmap_numa_##K##_##V##_get(hmap_numa_##K##_##V *h, const K *key, V *value)\
+{\
+    uint32_t hash = hmap_numa_##K##_##V##_hash(key);\
+    return hmap_numa_##K##_##V##_get_hashed(hmap_numa_##K##_##V##_owner_of(h, hash), key, hash, value);\
+}\
+\
+bool hmap_numa_##K##_##V##_remove(hmap_numa_##K##_##V *h, const K *key)\
+{\
+    uint32_t hash = hmap_numa_##K##_##V##_hash(key);\
+    return hmap_numa_##K##_##V##_remove_hashed(hmap_numa_##K##_##V##_owner_of(h, hash), key, hash);\
+}\
+\
+bool hmap_numa_##K##_##V##_shard_put(hmap_numa_##K##_##V##_shard *s, const K *key, const V *value)\
+{\
+    return hmap_numa_##K##_##V##_put_hashed(s, key, hmap_numa_##K##_##V##_hash(key), value);\
+}\
+\
+bool hmap_numa_##K##_##V##_shard_get(hmap_numa_##K##_##V##_shard *s, const K *key, V *value)\
+{\
+    return hmap_numa_##K##_##V##_get_hashed(s, key, hmap_numa_##K##_##V##_hash(key), value);\
+}\
+\
+bool hmap_numa_##K##_##V##_shard_remove(hmap_numa_##K##_##V##_shard *s, const K *key)\
+{\
+    return hmap_numa_##K##_##V##_remove_hashed(s, key, hmap_numa_##K##_##V##_hash(key));\
+}\
+\
+void hmap_numa_##K##_##V##_for_each(hmap_numa_##K##_##V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx)\
+{\
+    for (uint32_t i = 0; i < h->nshards; i++) {\
+        hmap_numa_##K##_##V##_shard *s = h->shards[i];\
+        pthread_rwlock_rdlock(&s->lock);\
+        for (uint32_t j = 0; j < s->cap; j++) {\
+            for (hmap_numa_##K##_##V##_entry *e = s->buckets[j]; e != NULL; e = e->next) {\
+                fn(&e->key, &e->value, ctx);\
+            }\
+        }\
+        pthread_rwlock_unlock(&s->lock);\
+    }\
+}\
+\
+uint32_t hmap_numa_##K##_##V##_len(hmap_numa_##K##_##V *h)\
+{\
+    uint32_t len = 0;\
+    for (uint32_t i = 0; i < h->nshards; i++) {\
+        len += __atomic_load_n(&h->shards[i]->len, __ATOMIC_RELAXED);\
+    }\
+    return len;\
+}\
+\
+void hmap_numa_##K##_##V##_stats(hmap_numa_##K##_##V *h, uint64_t *local, uint64_t *remote)\
+{\
+    *local = 0;\
+    *remote = 0;\
+    for (uint32_t i = 0; i < h->nshards; i++) {\
+        *local += __atomic_load_n(&h->shards[i]->local, __ATOMIC_RELAXED);\
+        *remote += __atomic_load_n(&h->shards[i]->remote, __ATOMIC_RELAXED);\
+    }\
+}
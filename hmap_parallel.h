@@ -0,0 +1,275 @@
+/*
+ * Multithreaded operations on a hashmap, using pthreads.
+ * Usage
+ * =====
+ * HMAP_DECLARE_PARALLEL(K, V)
+ *     Declares the functions for hmap_K_V, which must have been declared with HMAP_DECLARE(K, V) or
+ *     HMAP_DECLARE_SMALL(K, V).
+ * HMAP_DEFINE_PARALLEL(K, V, eq_func)
+ *     Defines the functions. Has to follow HMAP_DEFINE(K, V, hash_func, eq_func) in the same translation unit.
+ *
+ * Functions
+ * =========
+ * void hmap_K_V_build_parallel(hmap_K_V *h, const K *keys, const V *vals, size_t n, int threads):
+ *     Puts the n keys with their values into h, which must be initialised and empty, using that many threads.
+ *     Keys are hashed in parallel and partitioned by bucket index, then every thread fills its own range of buckets
+ *     of the presized table, so no locking is needed. The result is a normal hmap_K_V.
+ *     Keys and values are copied bitwise. If a key appears more than once, the later record replaces the earlier one
+ *     and the earlier key and value are destroyed, as with put_entry.
+ *
+ * void hmap_K_V_parallel_for_each(hmap_K_V *h, void (*fn)(hmap_K_V_entry *e, void *ctx), void *ctx, int threads):
+ *     Calls fn on every entry, using that many threads. Threads claim chunks of HMAP_PARALLEL_CHUNK buckets from a
+ *     shared cursor until none are left, so a thread stuck on long chains does not hold up the others.
+ *     fn runs concurrently, so access to ctx has to be synchronised. Modifying the hashmap or entry except for the
+ *     value is forbidden.
+ *
+ * void hmap_K_V_parallel_reduce(hmap_K_V *h, void (*fn)(hmap_K_V_entry *e, void *acc), void *acc, size_t acc_size, void (*init)(void *acc), void (*merge)(void *acc, const void *other), int threads):
+ *     Like parallel_for_each, but every thread passes fn its own accumulator of acc_size bytes, which is zeroed and
+ *     then given to init if it is not NULL. Once all entries are visited, every thread accumulator is folded into
+ *     acc with merge, one after another on the calling thread.
+ *
+ * Example
+ * =======
+ * HMAP_DECLARE(int, int)
+ * HMAP_DECLARE_PARALLEL(int, int)
+ * HMAP_DEFINE(int, int, hash_func, eq_func)
+ * HMAP_DEFINE_PARALLEL(int, int, eq_func)
+ *
+ * hmap_int_int h;
+ * hmap_int_int_init(&h, NULL, NULL);
+ * hmap_int_int_build_parallel(&h, keys, vals, n, 8);
+ * long sum = 0;
+ * hmap_int_int_parallel_reduce(&h, add_value, &sum, sizeof(sum), NULL, add_sums, 8); // add_value: *(long *)acc += e->value
+ * hmap_int_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hmap.h"
+
+#define HMAP_PARALLEL_CHUNK 256
+
+typedef struct hmap_parallel_task {
+    void (*fn)(void *ctx, int thread);
+    void *ctx;
+    int  thread;
+} hmap_parallel_task;
+
+static inline void *hmap_parallel_thread(void *arg)
+{
+    hmap_parallel_task *task = arg;
+    task->fn(task->ctx, task->thread);
+    return NULL;
+}
+
+/* runs fn(ctx, t) for every t in [0, threads) concurrently, t = 0 on the calling thread */
+static inline void hmap_parallel_run(int threads, void (*fn)(void *ctx, int thread), void *ctx)
+{
+    pthread_t *tids = malloc(threads * sizeof(*tids));
+    hmap_parallel_task *tasks = malloc(threads * sizeof(*tasks));
+    bool *started = malloc(threads * sizeof(*started));
+    for (int t = 1; t < threads; t++) {
+        tasks[t] = (hmap_parallel_task){fn, ctx, t};
+        started[t] = pthread_create(&tids[t], NULL, hmap_parallel_thread, &tasks[t]) == 0;
+    }
+    fn(ctx, 0);
+    for (int t = 1; t < threads; t++) {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+        else
+            fn(ctx, t);
+    }
+    free(tids);
+    free(tasks);
+    free(started);
+}
+
+#define HMAP_DECLARE_PARALLEL(K, V) \
+void hmap_##K##_##V##_build_parallel(hmap_##K##_##V *h, const K *keys, const V *vals, size_t n, int threads);\
+void hmap_##K##_##V##_parallel_for_each(hmap_##K##_##V *h, void (*fn)(hmap_##K##_##V##_entry *e, void *ctx), void *ctx, int threads);\
+void hmap_##K##_##V##_parallel_reduce(hmap_##K##_##V *h, void (*fn)(hmap_##K##_##V##_entry *e, void *acc), void *acc, size_t acc_size, void (*init)(void *acc), void (*merge)(void *acc, const void *other), int threads);
+
+#define HMAP_DEFINE_PARALLEL(K, V, eq_func)\
+typedef struct hmap_##K##_##V##_build_ctx {\
+    hmap_##K##_##V *h;\
+    const K        *keys;\
+    const V        *vals;\
+    size_t         n;\
+    int            threads;\
+    uint32_t       parts;\
+    uint32_t       shift;\
+    uint32_t       *hashes;\
+    size_t         *perm;\
+    /* counts[t * parts + p]: records of thread t in partition p, then where thread t scatters them */\
+    size_t         *counts;\
+    size_t         *part_start;\
+    uint32_t       *part_added;\
+} hmap_##K##_##V##_build_ctx;\
+\
+static void hmap_##K##_##V##_build_hash(void *arg, int t)\
+{\
+    hmap_##K##_##V##_build_ctx *c = arg;\
+    size_t *counts = &c->counts[(size_t)t * c->parts];\
+    size_t end = c->n * (t + 1) / c->threads;\
+    for (size_t i = c->n * t / c->threads; i < end; i++) {\
+        c->hashes[i] = hmap_##K##_##V##_hash(&c->keys[i]);\
+        counts[(c->hashes[i] & (c->h->cap - 1)) >> c->shift]++;\
+    }\
+}\
+\
+static void hmap_##K##_##V##_build_scatter(void *arg, int t)\
+{\
+    hmap_##K##_##V##_build_ctx *c = arg;\
+    size_t *offsets = &c->counts[(size_t)t * c->parts];\
+    size_t end = c->n * (t + 1) / c->threads;\
+    for (size_t i = c->n * t / c->threads; i < end; i++) {\
+        c->perm[offsets[(c->hashes[i] & (c->h->cap - 1)) >> c->shift]++] = i;\
+    }\
+}\
+\
+static void hmap_##K##_##V##_build_fill(void *arg, int t)\
+{\
+    hmap_##K##_##V##_build_ctx *c = arg;\
+    hmap_##K##_##V *h = c->h;\
+    for (uint32_t p = t; p < c->parts; p += c->threads) {\
+        uint32_t added = 0;\
+        for (size_t j = c->part_start[p]; j < c->part_start[p + 1]; j++) {\
+            size_t i = c->perm[j];\
+            uint32_t hash = c->hashes[i];\
+            hmap_##K##_##V##_entry **e = &h->buckets[hash & (h->cap - 1)];\
+            for (; *e != NULL; e = &(*e)->next) {\
+                if ((*e)->hash == hash && eq_func(&(*e)->key, &c->keys[i])) {\
+                    break;\
+                }\
+            }\
+            if (*e == NULL) {\
+                *e = malloc(sizeof(**e));\
+                (*e)->hash = hash;\
+                (*e)->next = NULL;\
+                added++;\
+            } else {\
+                if (h->key_destructor != NULL) h->key_destructor(&(*e)->key);\
+                if (h->value_destructor != NULL) h->value_destructor(&(*e)->value);\
+            }\
+            (*e)->key = c->keys[i];\
+            (*e)->value = c->vals[i];\
+        }\
+        c->part_added[p] = added;\
+    }\
+}\
+\
+void hmap_##K##_##V##_build_parallel(hmap_##K##_##V *h, const K *keys, const V *vals, size_t n, int threads)\
+{\
+    if (threads < 1)\
+        threads = 1;\
+    uint32_t cap = h->cap;\
+    while (cap * h->load_factor <= n)\
+        cap <<= 1;\
+    if (cap != h->cap || h->buckets == NULL) {\
+        hmap_buckets_free(h->buckets, h->cap * sizeof(*h->buckets));\
+        h->cap = cap;\
+        h->threshold = h->load_factor * cap;\
+        h->buckets = hmap_buckets_alloc(cap * sizeof(*h->buckets));\
+    }\
+\
+    /* partitions are the top bits of the bucket index, so each one is a contiguous range of buckets */\
+    uint32_t parts = 1, shift = 0;\
+    while (cap > 1 && parts < (uint32_t)threads && parts < cap)\
+        parts <<= 1;\
+    while ((cap >> shift) > parts)\
+        shift++;\
+\
+    hmap_##K##_##V##_build_ctx c = {\
+        .h = h, .keys = keys, .vals = vals, .n = n, .threads = threads, .parts = parts, .shift = shift,\
+        .hashes = malloc(n * sizeof(*c.hashes)),\
+        .perm = malloc(n * sizeof(*c.perm)),\
+        .counts = calloc((size_t)threads * parts, sizeof(*c.counts)),\
+        .part_start = malloc((parts + 1) * sizeof(*c.part_start)),\
+        .part_added = malloc(parts * sizeof(*c.part_added)),\
+    };\
+    hmap_parallel_run(threads, hmap_##K##_##V##_build_hash, &c);\
+    /* partition major, then thread, so records of a partition stay in input order */\
+    size_t offset = 0;\
+    for (uint32_t p = 0; p < parts; p++) {\
+        c.part_start[p] = offset;\
+        for (int t = 0; t < threads; t++) {\
+            size_t count = c.counts[(size_t)t * parts + p];\
+            c.counts[(size_t)t * parts + p] = offset;\
+            offset += count;\
+        }\
+    }\
+    c.part_start[parts] = offset;\
+    hmap_parallel_run(threads, hmap_##K##_##V##_build_scatter, &c);\
+    hmap_parallel_run(threads, hmap_##K##_##V##_build_fill, &c);\
+    for (uint32_t p = 0; p < parts; p++)\
+        h->len += c.part_added[p];\
+\
+    free(c.hashes);\
+    free(c.perm);\
+    free(c.counts);\
+    free(c.part_start);\
+    free(c.part_added);\
+}\
+\
+typedef struct hmap_##K##_##V##_scan_ctx {\
+    hmap_##K##_##V *h;\
+    void           (*fn)(hmap_##K##_##V##_entry *e, void *ctx);\
+    /* shared context for for_each, or one accumulator per thread for reduce */\
+    void           *ctx;\
+    void           **accs;\
+    uint32_t       next;\
+} hmap_##K##_##V##_scan_ctx;\
+\
+static void hmap_##K##_##V##_scan_chunks(void *arg, int t)\
+{\
+    hmap_##K##_##V##_scan_ctx *c = arg;\
+    void *ctx = c->accs != NULL ? c->accs[t] : c->ctx;\
+    if (c->h->buckets == NULL) {\
+        for (uint32_t i = 0; t == 0 && i < c->h->len; i++) {\
+            c->fn(&hmap_##K##_##V##_small(c->h)[i], ctx);\
+        }\
+        return;\
+    }\
+    for (;;) {\
+        uint32_t start = __atomic_fetch_add(&c->next, HMAP_PARALLEL_CHUNK, __ATOMIC_RELAXED);\
+        if (start >= c->h->cap)\
+            break;\
+        uint32_t end = c->h->cap - start > HMAP_PARALLEL_CHUNK ? start + HMAP_PARALLEL_CHUNK : c->h->cap;\
+        for (uint32_t i = start; i < end; i++) {\
+            for (hmap_##K##_##V##_entry *e = c->h->buckets[i]; e != NULL; e = e->next) {\
+                c->fn(e, ctx);\
+            }\
+        }\
+    }\
+}\
+\
+void hmap_##K##_##V##_parallel_for_each(hmap_##K##_##V *h, void (*fn)(hmap_##K##_##V##_entry *e, void *ctx), void *ctx, int threads)\
+{\
+    if (threads < 1)\
+        threads = 1;\
+    hmap_##K##_##V##_scan_ctx c = {h, fn, ctx, NULL, 0};\
+    hmap_parallel_run(threads, hmap_##K##_##V##_scan_chunks, &c);\
+}\
+\
+void hmap_##K##_##V##_parallel_reduce(hmap_##K##_##V *h, void (*fn)(hmap_##K##_##V##_entry *e, void *acc), void *acc, size_t acc_size, void (*init)(void *acc), void (*merge)(void *acc, const void *other), int threads)\
+{\
+    if (threads < 1)\
+        threads = 1;\
+    hmap_##K##_##V##_scan_ctx c = {h, fn, NULL, malloc(threads * sizeof(void *)), 0};\
+    for (int t = 0; t < threads; t++) {\
+        c.accs[t] = calloc(1, acc_size);\
+        if (init != NULL) init(c.accs[t]);\
+    }\
+    hmap_parallel_run(threads, hmap_##K##_##V##_scan_chunks, &c);\
+    for (int t = 0; t < threads; t++) {\
+        merge(acc, c.accs[t]);\
+        free(c.accs[t]);\
+    }\
+    free(c.accs);\
+}
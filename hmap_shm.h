@@ -0,0 +1,396 @@
+/*
+ * Implements a generic hashmap living in a shared memory region, so that several processes use one copy of it.
+ * The region is a memfd (inherited by forked workers) or a named POSIX shared memory object. Entries link to each
+ * other by offsets from the start of the region, since every process maps it at a different address, and a process
+ * shared read-write lock in the region lets readers run concurrently while writers are serialised.
+ * The region has a fixed size chosen at creation. Pages are only backed by memory when they are first touched, so
+ * it can be generous. Keys and values are copied bitwise and must not contain pointers.
+ * The lock is not robust: a process dying while it holds the write lock blocks every other process using the map.
+ * Usage
+ * =====
+ * HMAP_SHM_DECLARE(K, V)
+ *     Defines structures hmap_shm_K_V and hmap_shm_K_V_entry, and declares the functions.
+ *     If K or V is a pointer, then it has to be typedef'd.
+ * HMAP_SHM_DEFINE(K, V, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ *
+ * Functions
+ * =========
+ * int hmap_shm_K_V_create(hmap_shm_K_V *h, const char *name, size_t size, float load_factor, uint32_t initial_capacity):
+ *     Creates a region of size bytes holding an empty map. If name is NULL the region is an anonymous memfd, shared
+ *     with the processes forked afterwards; otherwise it is the new POSIX shared memory object name.
+ *     Returns 0, or -1 with errno set.
+ *
+ * int hmap_shm_K_V_open(hmap_shm_K_V *h, const char *name):
+ *     Maps the existing map of the POSIX shared memory object name. Returns 0, or -1 with errno set; errno is EINVAL
+ *     if the object does not hold a map of this type, or its creator has not finished initialising it.
+ *
+ * void hmap_shm_K_V_close(hmap_shm_K_V *h):
+ *     Unmaps the region. It is freed once every process closed it, and for named ones it was shm_unlink'ed.
+ *
+ * bool hmap_shm_K_V_put(hmap_shm_K_V *h, const K *key, const V *value):
+ *     Puts the key with the value under the write lock. Returns false if the region is out of space.
+ *
+ * bool hmap_shm_K_V_get(hmap_shm_K_V *h, const K *key, V *value):
+ *     Copies the value associated with the key into value under the read lock. Returns false if it doesn't exist.
+ *
+ * bool hmap_shm_K_V_remove(hmap_shm_K_V *h, const K *key):
+ *     Removes the key under the write lock. Returns true if removed, false if it doesn't exist.
+ *
+ * void hmap_shm_K_V_for_each(hmap_shm_K_V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx):
+ *     Calls fn on every key and value under the read lock. fn must not use the map.
+ *
+ * uint32_t hmap_shm_K_V_len(hmap_shm_K_V *h):
+ *     Returns the number of entries.
+ *
+ * Example
+ * =======
+ * HMAP_SHM_DECLARE(int, int)
+ * HMAP_SHM_DEFINE(int, int, hash_func, eq_func)
+ *
+ * hmap_shm_int_int h;
+ * hmap_shm_int_int_create(&h, NULL, 1ull << 32, HMAP_DEFAULT_LOAD_FACTOR, HMAP_DEFAULT_INITIAL_CAPACITY);
+ * hmap_shm_int_int_put(&h, &(int){1}, &(int){2});
+ * if (fork() == 0) {
+ *     int v;
+ *     hmap_shm_int_int_get(&h, &(int){1}, &v);
+ *     printf("%d", v); // 2
+ * }
+ * hmap_shm_int_int_close(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "hmap.h"
+
+#define HMAP_SHM_MAGIC 0x31504d4853504d48ull
+
+/* shared by every process; offsets are from the start of the region, and 0 means none */
+typedef struct hmap_shm_header {
+    uint64_t         magic;
+    uint64_t         size;
+    uint64_t         used;
+    uint64_t         free_list;
+    uint64_t         buckets;
+    uint32_t         entry_size;
+    uint32_t         len;
+    uint32_t         cap;
+    float            load_factor;
+    uint32_t         threshold;
+    pthread_rwlock_t lock;
+} hmap_shm_header;
+
+/* per process view of a region */
+typedef struct hmap_shm_region {
+    hmap_shm_header *hdr;
+    char            *base;
+    size_t          size;
+    int             fd;
+} hmap_shm_region;
+
+static inline int hmap_shm_map(hmap_shm_region *r, int fd, size_t size)
+{
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    r->base = base;
+    r->hdr = base;
+    r->size = size;
+    r->fd = fd;
+    return 0;
+}
+
+static inline int hmap_shm_region_create(hmap_shm_region *r, const char *name, size_t size)
+{
+    int fd = name == NULL ? (int)syscall(SYS_memfd_create, "hmap", 0) : shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) != 0) {
+        int err = errno;
+        close(fd);
+        if (name != NULL) shm_unlink(name);
+        errno = err;
+        return -1;
+    }
+    if (hmap_shm_map(r, fd, size) != 0) {
+        int err = errno;
+        if (name != NULL) shm_unlink(name);
+        errno = err;
+        return -1;
+    }
+    r->hdr->size = size;
+    r->hdr->used = sizeof(hmap_shm_header);
+    r->hdr->free_list = 0;
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&r->hdr->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+/* called once the header is initialised: open refuses the region until the magic is stored */
+static inline void hmap_shm_region_publish(hmap_shm_region *r)
+{
+    __atomic_store_n(&r->hdr->magic, HMAP_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+static inline int hmap_shm_region_open(hmap_shm_region *r, const char *name, uint32_t entry_size)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hmap_shm_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (hmap_shm_map(r, fd, st.st_size) != 0)
+        return -1;
+    if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != HMAP_SHM_MAGIC || r->hdr->entry_size != entry_size || r->hdr->size != (uint64_t)st.st_size) {
+        munmap(r->base, r->size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void hmap_shm_region_close(hmap_shm_region *r)
+{
+    munmap(r->base, r->size);
+    close(r->fd);
+}
+
+/* bump allocates size bytes; 0 if the region is full */
+static inline uint64_t hmap_shm_alloc(hmap_shm_region *r, uint64_t size)
+{
+    uint64_t align = _Alignof(max_align_t);
+    uint64_t off = (r->hdr->used + align - 1) & ~(align - 1);
+    if (off + size > r->hdr->size)
+        return 0;
+    r->hdr->used = off + size;
+    return off;
+}
+
+#define HMAP_SHM_DECLARE(K, V) \
+typedef struct hmap_shm_##K##_##V##_entry {\
+    uint64_t next;\
+    uint32_t hash;\
+    K        key;\
+    V        value;\
+} hmap_shm_##K##_##V##_entry;\
+\
+typedef struct hmap_shm_##K##_##V {\
+    hmap_shm_region region;\
+} hmap_shm_##K##_##V;\
+\
+int      hmap_shm_##K##_##V##_create(hmap_shm_##K##_##V *h, const char *name, size_t size, float load_factor, uint32_t initial_capacity);\
+int      hmap_shm_##K##_##V##_open(hmap_shm_##K##_##V *h, const char *name);\
+void     hmap_shm_##K##_##V##_close(hmap_shm_##K##_##V *h);\
+bool     hmap_shm_##K##_##V##_put(hmap_shm_##K##_##V *h, const K *key, const V *value);\
+bool     hmap_shm_##K##_##V##_get(hmap_shm_##K##_##V *h, const K *key, V *value);\
+bool     hmap_shm_##K##_##V##_remove(hmap_shm_##K##_##V *h, const K *key);\
+void     hmap_shm_##K##_##V##_for_each(hmap_shm_##K##_##V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx);\
+uint32_t hmap_shm_##K##_##V##_len(hmap_shm_##K##_##V *h);
+
+#define HMAP_SHM_DEFINE(K, V, hash_func, eq_func)\
+static inline hmap_shm_##K##_##V##_entry *hmap_shm_##K##_##V##_at(const hmap_shm_##K##_##V *h, uint64_t off)\
+{\
+    return off != 0 ? (hmap_shm_##K##_##V##_entry *)(h->region.base + off) : NULL;\
+}\
+\
+static inline uint64_t *hmap_shm_##K##_##V##_buckets(const hmap_shm_##K##_##V *h)\
+{\
+    return (uint64_t *)(h->region.base + h->region.hdr->buckets);\
+}\
+\
+int hmap_shm_##K##_##V##_create(hmap_shm_##K##_##V *h, const char *name, size_t size, float load_factor, uint32_t initial_capacity)\
+{\
+    if (hmap_shm_region_create(&h->region, name, size) != 0)\
+        return -1;\
+    hmap_shm_header *hdr = h->region.hdr;\
+    uint32_t cap = 1;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    hdr->entry_size = sizeof(hmap_shm_##K##_##V##_entry);\
+    hdr->len = 0;\
+    hdr->cap = cap;\
+    hdr->load_factor = load_factor;\
+    hdr->threshold = load_factor * cap;\
+    /* the file is zero filled, so the buckets are already empty */\
+    hdr->buckets = hmap_shm_alloc(&h->region, cap * sizeof(uint64_t));\
+    if (hdr->buckets == 0) {\
+        hmap_shm_region_close(&h->region);\
+        if (name != NULL) shm_unlink(name);\
+        errno = ENOMEM;\
+        return -1;\
+    }\
+    hmap_shm_region_publish(&h->region);\
+    return 0;\
+}\
+\
+int hmap_shm_##K##_##V##_open(hmap_shm_##K##_##V *h, const char *name)\
+{\
+    return hmap_shm_region_open(&h->region, name, sizeof(hmap_shm_##K##_##V##_entry));\
+}\
+\
+void hmap_shm_##K##_##V##_close(hmap_shm_##K##_##V *h)\
+{\
+    hmap_shm_region_close(&h->region);\
+}\
+\
+static uint32_t hmap_shm_##K##_##V##_hash(const K *key) \
+{\
+    return hmap_mix(hash_func(key));\
+}\
+\
+static uint64_t hmap_shm_##K##_##V##_new_entry(hmap_shm_##K##_##V *h)\
+{\
+    hmap_shm_header *hdr = h->region.hdr;\
+    uint64_t off = hdr->free_list;\
+    if (off != 0) {\
+        hdr->free_list = hmap_shm_##K##_##V##_at(h, off)->next;\
+        return off;\
+    }\
+    return hmap_shm_alloc(&h->region, sizeof(hmap_shm_##K##_##V##_entry));\
+}\
+\
+static void hmap_shm_##K##_##V##_free_entry(hmap_shm_##K##_##V *h, uint64_t off)\
+{\
+    hmap_shm_##K##_##V##_at(h, off)->next = h->region.hdr->free_list;\
+    h->region.hdr->free_list = off;\
+}\
+\
+static void hmap_shm_##K##_##V##_resize(hmap_shm_##K##_##V *h)\
+{\
+    hmap_shm_header *hdr = h->region.hdr;\
+    uint32_t cap = hdr->cap << 1;\
+    uint64_t buckets_off = hmap_shm_alloc(&h->region, cap * sizeof(uint64_t));\
+    if (buckets_off == 0)\
+        return;\
+    uint64_t *old = hmap_shm_##K##_##V##_buckets(h);\
+    uint64_t *buckets = (uint64_t *)(h->region.base + buckets_off);\
+    memset(buckets, 0, cap * sizeof(uint64_t));\
+    for (uint32_t i = 0; i < hdr->cap; i++) {\
+        uint64_t off = old[i];\
+        while (off != 0) {\
+            hmap_shm_##K##_##V##_entry *e = hmap_shm_##K##_##V##_at(h, off);\
+            uint64_t next = e->next;\
+            e->next = buckets[e->hash & (cap - 1)];\
+            buckets[e->hash & (cap - 1)] = off;\
+            off = next;\
+        }\
+    }\
+    /* the old bucket array cannot be returned to the bump allocator, so it is carved into free entries */\
+    uint64_t old_off = hdr->buckets;\
+    uint64_t old_end = old_off + hdr->cap * sizeof(uint64_t);\
+    for (; old_off + sizeof(hmap_shm_##K##_##V##_entry) <= old_end; old_off += sizeof(hmap_shm_##K##_##V##_entry))\
+        hmap_shm_##K##_##V##_free_entry(h, old_off);\
+    hdr->buckets = buckets_off;\
+    hdr->cap = cap;\
+    hdr->threshold = hdr->load_factor * cap;\
+}\
+\
+static uint64_t *hmap_shm_##K##_##V##_find(const hmap_shm_##K##_##V *h, const K *key, uint32_t hash)\
+{\
+    uint64_t *off = &hmap_shm_##K##_##V##_buckets(h)[hash & (h->region.hdr->cap - 1)];\
+    for (; *off != 0; off = &hmap_shm_##K##_##V##_at(h, *off)->next) {\
+        hmap_shm_##K##_##V##_entry *e = hmap_shm_##K##_##V##_at(h, *off);\
+        if (e->hash == hash && eq_func(&e->key, key)) {\
+            break;\
+        }\
+    }\
+    return off;\
+}\
+\
+bool hmap_shm_##K##_##V##_put(hmap_shm_##K##_##V *h, const K *key, const V *value)\
+{\
+    hmap_shm_header *hdr = h->region.hdr;\
+    uint32_t hash = hmap_shm_##K##_##V##_hash(key);\
+    bool ok = true;\
+    pthread_rwlock_wrlock(&hdr->lock);\
+    if (hdr->len >= hdr->threshold) {\
+        hmap_shm_##K##_##V##_resize(h);\
+    }\
+    uint64_t *off = hmap_shm_##K##_##V##_find(h, key, hash);\
+    if (*off == 0) {\
+        uint64_t new_off = hmap_shm_##K##_##V##_new_entry(h);\
+        if (new_off != 0) {\
+            hmap_shm_##K##_##V##_entry *e = hmap_shm_##K##_##V##_at(h, new_off);\
+            e->next = 0;\
+            e->hash = hash;\
+            e->key = *key;\
+            *off = new_off;\
+            hdr->len++;\
+        }\
+        ok = new_off != 0;\
+    }\
+    if (ok)\
+        hmap_shm_##K##_##V##_at(h, *off)->value = *value;\
+    pthread_rwlock_unlock(&hdr->lock);\
+    return ok;\
+}\
+\
+bool hmap_shm_##K##_##V##_get(hmap_shm_##K##_##V *h, const K *key, V *value)\
+{\
+    uint32_t hash = hmap_shm_##K##_##V##_hash(key);\
+    pthread_rwlock_rdlock(&h->region.hdr->lock);\
+    hmap_shm_##K##_##V##_entry *e = hmap_shm_##K##_##V##_at(h, *hmap_shm_##K##_##V##_find(h, key, hash));\
+    if (e != NULL)\
+        *value = e->value;\
+    pthread_rwlock_unlock(&h->region.hdr->lock);\
+    return e != NULL;\
+}\
+\
+bool hmap_shm_##K##_##V##_remove(hmap_shm_##K##_##V *h, const K *key)\
+{\
+    uint32_t hash = hmap_shm_##K##_##V##_hash(key);\
+    pthread_rwlock_wrlock(&h->region.hdr->lock);\
+    uint64_t *prev_next = hmap_shm_##K##_##V##_find(h, key, hash);\
+    uint64_t off = *prev_next;\
+    if (off != 0) {\
+        *prev_next = hmap_shm_##K##_##V##_at(h, off)->next;\
+        hmap_shm_##K##_##V##_free_entry(h, off);\
+        h->region.hdr->len--;\
+    }\
+    pthread_rwlock_unlock(&h->region.hdr->lock);\
+    return off != 0;\
+}\
+\
+void hmap_shm_##K##_##V##_for_each(hmap_shm_##K##_##V *h, void (*fn)(const K *key, const V *value, void *ctx), void *ctx)\
+{\
+    pthread_rwlock_rdlock(&h->region.hdr->lock);\
+    uint64_t *buckets = hmap_shm_##K##_##V##_buckets(h);\
+    for (uint32_t i = 0; i < h->region.hdr->cap; i++) {\
+        for (hmap_shm_##K##_##V##_entry *e = hmap_shm_##K##_##V##_at(h, buckets[i]); e != NULL; e = hmap_shm_##K##_##V##_at(h, e->next)) {\
+            fn(&e->key, &e->value, ctx);\
+        }\
+    }\
+    pthread_rwlock_unlock(&h->region.hdr->lock);\
+}\
+\
+uint32_t hmap_shm_##K##_##V##_len(hmap_shm_##K##_##V *h)\
+{\
+    return __atomic_load_n(&h->region.hdr->len, __ATOMIC_RELAXED);\
+}
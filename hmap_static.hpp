@@ -0,0 +1,191 @@
+/*
+ * Implements a read-only map built at compile time (C++20): the entries of an initializer list are placed by a
+ * minimal perfect hash, so a lookup hashes the key, reads one seed and compares one entry. The whole map is a
+ * constant, so declared constexpr it needs no initialisation at startup and lives in .rodata. Maps with pointers in
+ * them, such as std::string_view keys, live in .data.rel.ro instead, which the loader relocates then makes read-only.
+ * The hash is found by hash and displace: keys are split into N buckets, and buckets, largest first, search for a
+ * seed placing all their keys in free slots. Building is done by the compiler, so large maps may need a higher
+ * -fconstexpr-ops-limit (gcc) or -fconstexpr-steps (clang).
+ * Usage
+ * =====
+ * hmap::static_map<K, V, N, Hash = hmap::static_hash<K>, Eq = std::equal_to<K>>
+ *     K, V: literal types, default constructible and copyable, such as integers, enums or std::string_view.
+ *     Hash: constexpr callable as hash(const K &), returning uint64_t. Need not be good, it is mixed.
+ *     Eq:   constexpr callable as eq(const K &, const K &), returning bool.
+ * for (auto &e : m)
+ *     Iterates the entries, e.key and e.value, in slot order.
+ *
+ * Functions
+ * =========
+ * consteval static_map<K, V, N, Hash, Eq> make_static_map<K, V, Hash, Eq>(const std::pair<K, V> (&items)[N]):
+ *     Builds the map of items. Duplicate keys, or failing to find a hash, are compile errors.
+ *
+ * constexpr const V *get(const K &key):
+ *     Gets a pointer to the value associated with the key; returns nullptr if it doesn't exist.
+ *
+ * constexpr uint32_t size():
+ *     Returns the number of entries.
+ *
+ * hmap::static_hash<K>:
+ *     The default hash: FNV-1a of the characters for types convertible to std::string_view, the value for integers
+ *     and enums.
+ *
+ * Example
+ * =======
+ * enum cmd { CMD_GET, CMD_PUT, CMD_DEL };
+ * static constexpr auto commands = hmap::make_static_map<std::string_view, cmd>({
+ *     {"get", CMD_GET}, {"put", CMD_PUT}, {"del", CMD_DEL},
+ * });
+ * static_assert(*commands.get("put") == CMD_PUT);
+ * const cmd *c = commands.get(argv[1]); // NULL if unknown
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace hmap {
+
+template <class K>
+struct static_hash {
+    constexpr uint64_t operator()(const K &key) const
+    {
+        if constexpr (std::is_integral_v<K> || std::is_enum_v<K>) {
+            return static_cast<uint64_t>(key);
+        } else {
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (char c : std::string_view(key))
+                h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+            return h;
+        }
+    }
+};
+
+template <class K, class V, std::size_t N, class Hash = static_hash<K>, class Eq = std::equal_to<K>>
+class static_map {
+    static_assert(N > 0 && N <= UINT32_MAX, "static_map holds 1 to UINT32_MAX entries");
+public:
+    struct entry {
+        K key;
+        V value;
+    };
+
+    constexpr const V *get(const K &key) const
+    {
+        uint64_t h = Hash()(key);
+        const entry &e = entries[slot(h, seeds[bucket(h)])];
+        return Eq()(e.key, key) ? &e.value : nullptr;
+    }
+
+    constexpr uint32_t size() const { return N; }
+
+    constexpr const entry *begin() const { return entries; }
+    constexpr const entry *end() const { return entries + N; }
+
+    static consteval static_map build(const std::pair<K, V> (&items)[N])
+    {
+        static_map m{};
+        uint64_t hashes[N] = {};
+        /* keys grouped by bucket: the keys of bucket b are order[start[b]] to order[start[b + 1]] */
+        uint32_t start[N + 1] = {};
+        uint32_t order[N] = {};
+        uint32_t buckets[N] = {};
+        bool used[N] = {};
+
+        for (uint32_t i = 0; i < N; i++) {
+            hashes[i] = Hash()(items[i].first);
+            start[bucket(hashes[i]) + 1]++;
+        }
+        for (uint32_t b = 0; b < N; b++)
+            start[b + 1] += start[b];
+        uint32_t fill[N] = {};
+        for (uint32_t i = 0; i < N; i++) {
+            uint32_t b = bucket(hashes[i]);
+            order[start[b] + fill[b]++] = i;
+        }
+
+        for (uint32_t b = 0; b < N; b++)
+            buckets[b] = b;
+        std::sort(buckets, buckets + N, [&](uint32_t x, uint32_t y) {
+            return start[x + 1] - start[x] > start[y + 1] - start[y];
+        });
+
+        for (uint32_t bi = 0; bi < N; bi++) {
+            uint32_t b = buckets[bi];
+            uint32_t first = start[b], last = start[b + 1];
+            if (first == last)
+                break;
+            for (uint32_t i = first; i < last; i++) {
+                for (uint32_t j = first; j < i; j++) {
+                    if (Eq()(items[order[i]].first, items[order[j]].first))
+                        throw "hmap::make_static_map: duplicate key";
+                }
+            }
+            uint32_t seed = 0;
+            for (;; seed++) {
+                if (seed == UINT32_MAX)
+                    throw "hmap::make_static_map: no perfect hash found";
+                uint32_t i = first;
+                for (; i < last; i++) {
+                    uint32_t s = slot(hashes[order[i]], seed);
+                    bool taken = used[s];
+                    for (uint32_t j = first; j < i && !taken; j++)
+                        taken = slot(hashes[order[j]], seed) == s;
+                    if (taken)
+                        break;
+                }
+                if (i == last)
+                    break;
+            }
+            m.seeds[b] = seed;
+            for (uint32_t i = first; i < last; i++) {
+                uint32_t s = slot(hashes[order[i]], seed);
+                used[s] = true;
+                m.entries[s] = entry{items[order[i]].first, items[order[i]].second};
+            }
+        }
+        return m;
+    }
+
+private:
+    /* splitmix64 finalizer, so weak hashes such as the identity on integers spread over the buckets */
+    static constexpr uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    /* maps 32 bits onto [0, N) by multiplying, without a division */
+    static constexpr uint32_t range(uint64_t x)
+    {
+        return static_cast<uint32_t>(((x >> 32) * N) >> 32);
+    }
+
+    static constexpr uint32_t bucket(uint64_t h)
+    {
+        return range(mix(h));
+    }
+
+    static constexpr uint32_t slot(uint64_t h, uint32_t seed)
+    {
+        return range(mix(h + (seed + 1ull) * 0x9e3779b97f4a7c15ull));
+    }
+
+    uint32_t seeds[N];
+    entry    entries[N];
+};
+
+template <class K, class V, class Hash = static_hash<K>, class Eq = std::equal_to<K>, std::size_t N>
+consteval static_map<K, V, N, Hash, Eq> make_static_map(const std::pair<K, V> (&items)[N])
+{
+    return static_map<K, V, N, Hash, Eq>::build(items);
+}
+
+}
@@ -0,0 +1,222 @@
+/*
+ * Implements a hashmap specialised for string keys, with a built-in hash.
+ * The key bytes are stored in the entry itself: keys of up to HMAP_STR_INLINE_LEN bytes fit in the fixed size entry,
+ * longer ones are allocated together with it. Comparison checks hash and length before the bytes, so a lookup
+ * touches no memory other than the bucket array and the entries of the chain.
+ * Usage
+ * =====
+ * HMAP_DECLARE_STR(V)
+ *     Defines structures hmap_str_V and hmap_str_V_entry, and declares the functions.
+ *     If V is a pointer, then it has to be typedef'd.
+ * HMAP_DEFINE_STR(V)
+ *     Defines the functions.
+ * HMAP_ITER_BEGIN(h, element_name) and HMAP_ITER_END from hmap.h iterate over hmap_str_V as well.
+ *     element_name->key is a NUL terminated string of element_name->len bytes.
+ *
+ * Functions
+ * =========
+ * uint32_t hmap_str_hash(const char *key, size_t len):
+ *     The hash used by the map.
+ *
+ * void hmap_str_V_init_custom(hmap_str_V *h, float load_factor, uint32_t initial_capacity, void (*value_destructor)(V *value)):
+ *     Initiates the hashmap with given parameters. initial capacity is rounded to next power of 2.
+ *     Destructor can be NULL in which case it is ignored. Keys are owned by the map, so there is no key destructor.
+ *
+ * void hmap_str_V_init(hmap_str_V *h, void (*value_destructor)(V *value)):
+ *     init_custom with default parameters + destructor forwarded.
+ *
+ * V *hmap_str_V_put(hmap_str_V *h, const char *key, size_t len):
+ *     Puts the key, copying its len bytes, returning a pointer to the value. Allocates new entry if required.
+ *     key does not need to be NUL terminated. Returns NULL if len is above UINT32_MAX, as lengths are stored in 32 bits.
+ *
+ * V *hmap_str_V_get(const hmap_str_V *h, const char *key, size_t len):
+ *     Gets a pointer to the value associated with the key; returns NULL if it doesn't exist.
+ *
+ * bool hmap_str_V_remove(hmap_str_V *h, const char *key, size_t len):
+ *     Removes the entry associated with the key from the map, freeing it and calling destructor for value.
+ *     Returns true if removed, false if it doesn't exist.
+ *
+ * void hmap_str_V_destroy(hmap_str_V *h):
+ *     Destroys the map by freeing memory, and calling destructor of values.
+ *
+ * Example
+ * =======
+ * HMAP_DECLARE_STR(int)
+ * HMAP_DEFINE_STR(int)
+ *
+ * hmap_str_int h;
+ * hmap_str_int_init(&h, NULL);
+ * *hmap_str_int_put(&h, "one", 3) = 1;
+ * printf("%d", *hmap_str_int_get(&h, "one", 3)); // 1
+ * hmap_str_int_remove(&h, "one", 3);
+ * hmap_str_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmap.h"
+
+#define HMAP_STR_INLINE_LEN 23
+
+static inline uint32_t hmap_str_hash(const char *key, size_t len)
+{
+    /* multiply-xorshift over 8 byte words, finished with the splitmix64 mixer */
+    const uint64_t m = 0x9e3779b97f4a7c15ull;
+    uint64_t h = len * m;
+    uint64_t w;
+    for (; len >= 8; key += 8, len -= 8) {
+        memcpy(&w, key, 8);
+        h = (h ^ w) * m;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, key, len);
+    h = (h ^ w) * m;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+#define HMAP_DECLARE_STR(V) \
+typedef struct hmap_str_##V##_entry hmap_str_##V##_entry;\
+typedef struct hmap_str_##V##_entry {\
+    uint32_t             hash;\
+    uint32_t             len;\
+    hmap_str_##V##_entry *next;\
+    V                    value;\
+    char                 key[HMAP_STR_INLINE_LEN + 1];\
+} hmap_str_##V##_entry;\
+\
+typedef struct hmap_str_##V {\
+    uint32_t             len;\
+    uint32_t             cap;\
+    float                load_factor;\
+    uint32_t             threshold;\
+    void                 (*value_destructor)(V *value);\
+    hmap_str_##V##_entry **buckets;\
+} hmap_str_##V;\
+\
+void hmap_str_##V##_init_custom(hmap_str_##V *h, float load_factor, uint32_t initial_capacity, void (*value_destructor)(V *value));\
+void hmap_str_##V##_init(hmap_str_##V *h, void (*value_destructor)(V *value));\
+V   *hmap_str_##V##_put(hmap_str_##V *h, const char *key, size_t len);\
+V   *hmap_str_##V##_get(const hmap_str_##V *h, const char *key, size_t len);\
+bool hmap_str_##V##_remove(hmap_str_##V *h, const char *key, size_t len);\
+void hmap_str_##V##_destroy(hmap_str_##V *h);
+
+#define HMAP_DEFINE_STR(V)\
+void hmap_str_##V##_init_custom(hmap_str_##V *h, float load_factor, uint32_t initial_capacity, void (*value_destructor)(V *value))\
+{\
+    h->len = 0;\
+    uint32_t cap = 1;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    h->cap = cap;\
+    h->load_factor = load_factor;\
+    h->threshold = load_factor * h->cap;\
+    h->value_destructor = value_destructor;\
+    h->buckets = calloc(h->cap, sizeof(*h->buckets));\
+}\
+\
+void hmap_str_##V##_init(hmap_str_##V *h, void (*value_destructor)(V *value))\
+{\
+    hmap_str_##V##_init_custom(h, HMAP_DEFAULT_LOAD_FACTOR, HMAP_DEFAULT_INITIAL_CAPACITY, value_destructor);\
+}\
+\
+static void hmap_str_##V##_resize(hmap_str_##V *h) \
+{\
+    hmap_str_##V new = *h;\
+    new.cap <<= 1;\
+    new.threshold = new.load_factor * new.cap;\
+    new.buckets = calloc(new.cap, sizeof(*new.buckets));\
+\
+    for (uint32_t i = 0; i < h->cap; i++) {\
+        hmap_str_##V##_entry *e = h->buckets[i];\
+        while (e != NULL) {\
+            hmap_str_##V##_entry *next = e->next;\
+            uint32_t new_hash = e->hash & (new.cap - 1);\
+            e->next = new.buckets[new_hash];\
+            new.buckets[new_hash] = e;\
+            e = next;\
+        }\
+    }\
+    free(h->buckets);\
+    *h = new;\
+}\
+\
+static hmap_str_##V##_entry **hmap_str_##V##_find(const hmap_str_##V *h, const char *key, size_t len, uint32_t hash)\
+{\
+    hmap_str_##V##_entry **e = &h->buckets[hash & (h->cap - 1)];\
+    for (; *e != NULL; e = &(*e)->next) {\
+        if ((*e)->hash == hash && (*e)->len == len && memcmp((*e)->key, key, len) == 0) {\
+            break;\
+        }\
+    }\
+    return e;\
+}\
+\
+V *hmap_str_##V##_put(hmap_str_##V *h, const char *key, size_t len)\
+{\
+    if (len > UINT32_MAX) {\
+        return NULL;\
+    }\
+    if (h->len >= h->threshold) {\
+        hmap_str_##V##_resize(h);\
+    }\
+    uint32_t hash = hmap_str_hash(key, len);\
+    hmap_str_##V##_entry **e = hmap_str_##V##_find(h, key, len, hash);\
+    if (*e != NULL) {\
+        return &(*e)->value;\
+    }\
+    size_t size = offsetof(hmap_str_##V##_entry, key) + len + 1;\
+    hmap_str_##V##_entry *new_entry = malloc(size > sizeof(*new_entry) ? size : sizeof(*new_entry));\
+    new_entry->hash = hash;\
+    new_entry->len = len;\
+    new_entry->next = NULL;\
+    memcpy(new_entry->key, key, len);\
+    new_entry->key[len] = '\0';\
+    *e = new_entry;\
+    h->len++;\
+    return &new_entry->value;\
+}\
+\
+V *hmap_str_##V##_get(const hmap_str_##V *h, const char *key, size_t len)\
+{\
+    hmap_str_##V##_entry *e = *hmap_str_##V##_find(h, key, len, hmap_str_hash(key, len));\
+    return e != NULL ? &e->value : NULL;\
+}\
+\
+bool hmap_str_##V##_remove(hmap_str_##V *h, const char *key, size_t len)\
+{\
+    hmap_str_##V##_entry **prev_next = hmap_str_##V##_find(h, key, len, hmap_str_hash(key, len));\
+    hmap_str_##V##_entry *e = *prev_next;\
+    if (e == NULL)\
+        return false;\
+    *prev_next = e->next;\
+    h->len--;\
+    if (h->value_destructor != NULL) h->value_destructor(&e->value);\
+    free(e);\
+    return true;\
+}\
+\
+void hmap_str_##V##_destroy(hmap_str_##V *h)\
+{\
+    for (uint32_t i = 0; i < h->cap; i++) {\
+        hmap_str_##V##_entry *e = h->buckets[i];\
+        while (e != NULL) {\
+            hmap_str_##V##_entry *next = e->next;\
+            if (h->value_destructor != NULL) h->value_destructor(&e->value);\
+            free(e);\
+            e = next;\
+        }\
+    }\
+    free(h->buckets);\
+}
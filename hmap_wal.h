@@ -0,0 +1,558 @@
+/*
+ * Durable hashmap through a write-ahead log of its operations.
+ * Every put, put_entry and remove made through the log appends a small binary record: an operation byte, then the key
+ * and value bytes. Records are buffered and written as one checksummed group, which is synced once
+ * sync_interval_ms has passed since the previous sync, so many operations share one fdatasync. When the log grows
+ * past w->log.compact_bytes, HMAP_WAL_COMPACT_BYTES unless changed, it is compacted: the whole map is written to a
+ * snapshot, which atomically replaces the previous one, and the log is emptied. Recovery loads the snapshot and
+ * replays the complete groups of the log in batches into a table presized for the result. The files are
+ * path + ".snap" and path + ".log".
+ * Keys and values are written bitwise, so they must not contain pointers. A crash loses the operations since the
+ * last sync; the interval is only checked when an operation is made, so call sync when the map goes idle.
+ * Usage
+ * =====
+ * HMAP_WAL_DECLARE(K, V)
+ *     Defines structure hmap_wal_K_V, and declares the functions for hmap_K_V, which must have been declared with
+ *     HMAP_DECLARE(K, V) or HMAP_DECLARE_SMALL(K, V).
+ * HMAP_WAL_DEFINE(K, V)
+ *     Defines the functions. Has to follow HMAP_DEFINE(K, V, hash_func, eq_func) in the same translation unit.
+ *
+ * Functions
+ * =========
+ * int hmap_wal_K_V_open(hmap_wal_K_V *w, hmap_K_V *h, const char *path, uint32_t sync_interval_ms):
+ *     Recovers the map stored at path into h, which must be initialised and empty, and attaches the log to h.
+ *     With a sync_interval_ms of 0, every operation is synced. Returns 0, or -1 with errno set; errno is EINVAL if
+ *     the snapshot was written for other types, and EIO if it is corrupt.
+ *
+ * V *hmap_wal_K_V_put(hmap_wal_K_V *w, const K *key, const V *value):
+ *     Logs the operation, then puts the key with hmap_K_V_put, assigns the value and returns a pointer to it.
+ *     Writes through the pointer are not logged.
+ *
+ * void hmap_wal_K_V_put_entry(hmap_wal_K_V *w, hmap_K_V_entry *entry):
+ *     Logs the operation, then calls hmap_K_V_put_entry.
+ *
+ * bool hmap_wal_K_V_remove(hmap_wal_K_V *w, const K *key):
+ *     Logs the operation, then calls hmap_K_V_remove.
+ *
+ * int hmap_wal_K_V_sync(hmap_wal_K_V *w):
+ *     Writes and syncs the buffered records. Returns 0, or -1 with errno set to the first error the log has met.
+ *
+ * int hmap_wal_K_V_compact(hmap_wal_K_V *w):
+ *     Replaces the snapshot with the current map and empties the log. Returns 0, or -1 with errno set.
+ *
+ * int hmap_wal_K_V_close(hmap_wal_K_V *w):
+ *     Syncs and closes the log. The map stays attached to the caller. Returns the result of the sync.
+ *
+ * Example
+ * =======
+ * HMAP_DECLARE(int, int)
+ * HMAP_WAL_DECLARE(int, int)
+ * HMAP_DEFINE(int, int, hash_func, eq_func)
+ * HMAP_WAL_DEFINE(int, int)
+ *
+ * hmap_int_int h;
+ * hmap_wal_int_int w;
+ * hmap_int_int_init(&h, NULL, NULL);
+ * hmap_wal_int_int_open(&w, &h, "map", 10); // state of the last run
+ * hmap_wal_int_int_put(&w, &(int){1}, &(int){2});
+ * hmap_wal_int_int_remove(&w, &(int){3});
+ * hmap_wal_int_int_close(&w);
+ * hmap_int_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hmap.h"
+
+#define HMAP_WAL_SNAPSHOT_MAGIC 0x50414e534c415748ull
+#define HMAP_WAL_BUFFER_SIZE    (1u << 20)
+#define HMAP_WAL_COMPACT_BYTES  (64u << 20)
+#define HMAP_WAL_BATCH          256
+
+enum { HMAP_WAL_PUT = 1, HMAP_WAL_PUT_ENTRY = 2, HMAP_WAL_REMOVE = 3 };
+
+typedef struct hmap_wal_log {
+    char     *path;
+    int      fd;
+    int      error;
+    char     *buf;
+    size_t   buf_len;
+    uint32_t sync_interval_ms;
+    uint64_t last_sync_ms;
+    /* length of the log file, and when it gets compacted */
+    uint64_t bytes;
+    uint64_t compact_bytes;
+} hmap_wal_log;
+
+typedef struct hmap_wal_snapshot_header {
+    uint64_t magic;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint64_t len;
+} hmap_wal_snapshot_header;
+
+static inline uint64_t hmap_wal_checksum(uint64_t h, const char *data, size_t len)
+{
+    /* FNV-1a, starting from 0xcbf29ce484222325 */
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static inline uint64_t hmap_wal_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline char *hmap_wal_path(const char *path, const char *suffix)
+{
+    char *p = malloc(strlen(path) + strlen(suffix) + 1);
+    strcpy(p, path);
+    return strcat(p, suffix);
+}
+
+static inline int hmap_wal_write_all(int fd, const char *data, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static inline size_t hmap_wal_read_all(int fd, char *data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* the buffer holds a group being built: uint64_t payload length, records, then room for the uint64_t checksum */
+static inline int hmap_wal_write(hmap_wal_log *l)
+{
+    uint64_t payload = l->buf_len - sizeof(uint64_t);
+    if (payload == 0)
+        return 0;
+    uint64_t checksum = hmap_wal_checksum(0xcbf29ce484222325ull, l->buf + sizeof(uint64_t), payload);
+    memcpy(l->buf, &payload, sizeof(uint64_t));
+    memcpy(l->buf + l->buf_len, &checksum, sizeof(uint64_t));
+    if (hmap_wal_write_all(l->fd, l->buf, l->buf_len + sizeof(uint64_t), l->bytes) != 0) {
+        /* the group is dropped; the error stays until the log is closed */
+        l->error = l->error ? l->error : errno;
+        l->buf_len = sizeof(uint64_t);
+        return -1;
+    }
+    l->bytes += l->buf_len + sizeof(uint64_t);
+    l->buf_len = sizeof(uint64_t);
+    return 0;
+}
+
+static inline int hmap_wal_sync(hmap_wal_log *l)
+{
+    if (hmap_wal_write(l) == 0 && fdatasync(l->fd) != 0 && l->error == 0)
+        l->error = errno;
+    l->last_sync_ms = hmap_wal_now_ms();
+    errno = l->error;
+    return l->error ? -1 : 0;
+}
+
+/* returns where to copy a record of len bytes */
+static inline char *hmap_wal_append(hmap_wal_log *l, size_t len)
+{
+    if (l->buf_len + len + sizeof(uint64_t) > HMAP_WAL_BUFFER_SIZE)
+        hmap_wal_write(l);
+    char *record = l->buf + l->buf_len;
+    l->buf_len += len;
+    return record;
+}
+
+/* called once the record is appended; true if the log is due for compaction */
+static inline bool hmap_wal_appended(hmap_wal_log *l)
+{
+    if (l->sync_interval_ms == 0 || hmap_wal_now_ms() - l->last_sync_ms >= l->sync_interval_ms)
+        hmap_wal_sync(l);
+    return l->bytes >= l->compact_bytes;
+}
+
+static inline int hmap_wal_log_open(hmap_wal_log *l, const char *path, uint32_t sync_interval_ms, size_t record_size)
+{
+    l->path = hmap_wal_path(path, "");
+    char *log_path = hmap_wal_path(path, ".log");
+    l->fd = open(log_path, O_RDWR | O_CREAT, 0600);
+    free(log_path);
+    if (l->fd < 0) {
+        free(l->path);
+        return -1;
+    }
+    l->error = 0;
+    /* a record never spans two groups */
+    l->buf = malloc(HMAP_WAL_BUFFER_SIZE + record_size);
+    l->buf_len = sizeof(uint64_t);
+    l->sync_interval_ms = sync_interval_ms;
+    l->last_sync_ms = hmap_wal_now_ms();
+    l->bytes = 0;
+    l->compact_bytes = HMAP_WAL_COMPACT_BYTES;
+    return 0;
+}
+
+static inline void hmap_wal_log_close(hmap_wal_log *l)
+{
+    close(l->fd);
+    free(l->buf);
+    free(l->path);
+}
+
+/* renames tmp over the snapshot, then empties the log, as the snapshot holds all of it */
+static inline int hmap_wal_install(hmap_wal_log *l, const char *tmp)
+{
+    char *snap = hmap_wal_path(l->path, ".snap");
+    char *dir = hmap_wal_path(l->path, "");
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL)
+        slash[slash == dir] = '\0';
+    int ret = rename(tmp, snap);
+    int dir_fd = ret == 0 ? open(slash != NULL ? dir : ".", O_RDONLY | O_DIRECTORY) : -1;
+    if (ret == 0 && (dir_fd < 0 || fsync(dir_fd) != 0))
+        ret = -1;
+    if (dir_fd >= 0)
+        close(dir_fd);
+    if (ret == 0 && (ftruncate(l->fd, 0) != 0 || fdatasync(l->fd) != 0))
+        ret = -1;
+    free(snap);
+    free(dir);
+    if (ret != 0)
+        return -1;
+    l->bytes = 0;
+    l->buf_len = sizeof(uint64_t);
+    l->last_sync_ms = hmap_wal_now_ms();
+    return 0;
+}
+
+#define HMAP_WAL_DECLARE(K, V) \
+typedef struct hmap_wal_##K##_##V {\
+    hmap_##K##_##V *h;\
+    hmap_wal_log   log;\
+} hmap_wal_##K##_##V;\
+\
+int  hmap_wal_##K##_##V##_open(hmap_wal_##K##_##V *w, hmap_##K##_##V *h, const char *path, uint32_t sync_interval_ms);\
+V   *hmap_wal_##K##_##V##_put(hmap_wal_##K##_##V *w, const K *key, const V *value);\
+void hmap_wal_##K##_##V##_put_entry(hmap_wal_##K##_##V *w, hmap_##K##_##V##_entry *entry);\
+bool hmap_wal_##K##_##V##_remove(hmap_wal_##K##_##V *w, const K *key);\
+int  hmap_wal_##K##_##V##_sync(hmap_wal_##K##_##V *w);\
+int  hmap_wal_##K##_##V##_compact(hmap_wal_##K##_##V *w);\
+int  hmap_wal_##K##_##V##_close(hmap_wal_##K##_##V *w);
+
+#define HMAP_WAL_DEFINE(K, V)\
+static void hmap_wal_##K##_##V##_presize(hmap_##K##_##V *h, size_t n)\
+{\
+    while (n >= h->threshold) {\
+        hmap_##K##_##V##_resize(h);\
+    }\
+}\
+\
+/* snapshot keys are unique, so entries are pushed without looking for the key */\
+static void hmap_wal_##K##_##V##_load_batch(hmap_##K##_##V *h, const char *records, uint32_t n)\
+{\
+    const size_t size = sizeof(K) + sizeof(V);\
+    uint32_t hashes[HMAP_WAL_BATCH];\
+    for (uint32_t i = 0; i < n; i++) {\
+        K key;\
+        memcpy(&key, records + i * size, sizeof(K));\
+        hashes[i] = hmap_##K##_##V##_hash(&key);\
+        if (h->buckets != NULL)\
+            __builtin_prefetch(&h->buckets[hashes[i] & (h->cap - 1)], 1);\
+    }\
+    for (uint32_t i = 0; i < n; i++) {\
+        hmap_##K##_##V##_entry e;\
+        e.hash = hashes[i];\
+        memcpy(&e.key, records + i * size, sizeof(K));\
+        memcpy(&e.value, records + i * size + sizeof(K), sizeof(V));\
+        hmap_##K##_##V##_push(h, &e, false);\
+    }\
+}\
+\
+static int hmap_wal_##K##_##V##_load_snapshot(hmap_##K##_##V *h, const char *path)\
+{\
+    char *snap_path = hmap_wal_path(path, ".snap");\
+    int fd = open(snap_path, O_RDONLY);\
+    free(snap_path);\
+    if (fd < 0)\
+        return errno == ENOENT ? 0 : -1;\
+    hmap_wal_snapshot_header hdr;\
+    int err = 0;\
+    if (hmap_wal_read_all(fd, (char *)&hdr, sizeof(hdr)) != sizeof(hdr))\
+        err = EIO;\
+    else if (hdr.magic != HMAP_WAL_SNAPSHOT_MAGIC || hdr.key_size != sizeof(K) || hdr.value_size != sizeof(V))\
+        err = EINVAL;\
+    if (err == 0) {\
+        hmap_wal_##K##_##V##_presize(h, hdr.len);\
+        const size_t size = sizeof(K) + sizeof(V);\
+        char *records = malloc(HMAP_WAL_BATCH * size);\
+        uint64_t checksum = hmap_wal_checksum(0xcbf29ce484222325ull, (const char *)&hdr, sizeof(hdr));\
+        for (uint64_t done = 0; done < hdr.len && err == 0;) {\
+            uint32_t n = hdr.len - done < HMAP_WAL_BATCH ? hdr.len - done : HMAP_WAL_BATCH;\
+            if (hmap_wal_read_all(fd, records, n * size) != n * size) {\
+                err = EIO;\
+                break;\
+            }\
+            checksum = hmap_wal_checksum(checksum, records, n * size);\
+            hmap_wal_##K##_##V##_load_batch(h, records, n);\
+            done += n;\
+        }\
+        uint64_t stored;\
+        if (err == 0 && (hmap_wal_read_all(fd, (char *)&stored, sizeof(stored)) != sizeof(stored) || stored != checksum))\
+            err = EIO;\
+        free(records);\
+    }\
+    close(fd);\
+    errno = err;\
+    return err ? -1 : 0;\
+}\
+\
+static void hmap_wal_##K##_##V##_replay_batch(hmap_##K##_##V *h, const char **records, uint32_t n)\
+{\
+    uint32_t hashes[HMAP_WAL_BATCH];\
+    for (uint32_t i = 0; i < n; i++) {\
+        K key;\
+        memcpy(&key, records[i] + 1, sizeof(K));\
+        hashes[i] = hmap_##K##_##V##_hash(&key);\
+        if (h->buckets != NULL)\
+            __builtin_prefetch(&h->buckets[hashes[i] & (h->cap - 1)]);\
+    }\
+    for (uint32_t i = 0; i < n; i++) {\
+        K key;\
+        memcpy(&key, records[i] + 1, sizeof(K));\
+        if (records[i][0] == HMAP_WAL_REMOVE) {\
+            hmap_##K##_##V##_drop(h, hashes[i], &key);\
+            continue;\
+        }\
+        hmap_##K##_##V##_entry *found = hmap_##K##_##V##_find(h, hashes[i], &key);\
+        if (found == NULL) {\
+            hmap_##K##_##V##_entry e;\
+            e.hash = hashes[i];\
+            e.key = key;\
+            memcpy(&e.value, records[i] + 1 + sizeof(K), sizeof(V));\
+            hmap_##K##_##V##_push(h, &e, false);\
+            continue;\
+        }\
+        if (records[i][0] == HMAP_WAL_PUT_ENTRY) {\
+            if (h->key_destructor != NULL) h->key_destructor(&found->key);\
+            if (h->value_destructor != NULL) h->value_destructor(&found->value);\
+            found->key = key;\
+        }\
+        memcpy(&found->value, records[i] + 1 + sizeof(K), sizeof(V));\
+    }\
+}\
+\
+/* replays the complete groups of the log, and returns where the last one ends */\
+static uint64_t hmap_wal_##K##_##V##_replay(hmap_##K##_##V *h, const char *log, uint64_t len)\
+{\
+    const size_t put_size = 1 + sizeof(K) + sizeof(V);\
+    const size_t remove_size = 1 + sizeof(K);\
+    uint64_t end = 0, puts = 0;\
+    /* first validates the groups and counts the puts, to presize the table */\
+    for (;;) {\
+        uint64_t payload, checksum;\
+        if (len - end < 2 * sizeof(uint64_t))\
+            break;\
+        memcpy(&payload, log + end, sizeof(uint64_t));\
+        if (payload > len - end - 2 * sizeof(uint64_t))\
+            break;\
+        const char *p = log + end + sizeof(uint64_t);\
+        memcpy(&checksum, p + payload, sizeof(uint64_t));\
+        if (checksum != hmap_wal_checksum(0xcbf29ce484222325ull, p, payload))\
+            break;\
+        const char *q = p;\
+        uint64_t group_puts = 0;\
+        while (q < p + payload && (uint64_t)(p + payload - q) >= (*q == HMAP_WAL_REMOVE ? remove_size : put_size)) {\
+            group_puts += *q != HMAP_WAL_REMOVE;\
+            q += *q == HMAP_WAL_REMOVE ? remove_size : put_size;\
+        }\
+        if (q != p + payload)\
+            break;\
+        puts += group_puts;\
+        end += 2 * sizeof(uint64_t) + payload;\
+    }\
+    hmap_wal_##K##_##V##_presize(h, h->len + puts);\
+    const char *records[HMAP_WAL_BATCH];\
+    uint32_t n = 0;\
+    for (uint64_t pos = 0; pos < end;) {\
+        uint64_t payload;\
+        memcpy(&payload, log + pos, sizeof(uint64_t));\
+        const char *p = log + pos + sizeof(uint64_t);\
+        for (const char *q = p; q < p + payload; q += *q == HMAP_WAL_REMOVE ? remove_size : put_size) {\
+            records[n++] = q;\
+            if (n == HMAP_WAL_BATCH) {\
+                hmap_wal_##K##_##V##_replay_batch(h, records, n);\
+                n = 0;\
+            }\
+        }\
+        pos += 2 * sizeof(uint64_t) + payload;\
+    }\
+    hmap_wal_##K##_##V##_replay_batch(h, records, n);\
+    return end;\
+}\
+\
+int hmap_wal_##K##_##V##_open(hmap_wal_##K##_##V *w, hmap_##K##_##V *h, const char *path, uint32_t sync_interval_ms)\
+{\
+    w->h = h;\
+    if (hmap_wal_##K##_##V##_load_snapshot(h, path) != 0)\
+        return -1;\
+    if (hmap_wal_log_open(&w->log, path, sync_interval_ms, 1 + sizeof(K) + sizeof(V)) != 0)\
+        return -1;\
+    struct stat st;\
+    if (fstat(w->log.fd, &st) != 0)\
+        goto fail;\
+    if (st.st_size > 0) {\
+        char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, w->log.fd, 0);\
+        if (log == MAP_FAILED)\
+            goto fail;\
+        w->log.bytes = hmap_wal_##K##_##V##_replay(h, log, st.st_size);\
+        munmap(log, st.st_size);\
+        /* a torn group at the end would hide the groups appended after it */\
+        if ((uint64_t)st.st_size != w->log.bytes && (ftruncate(w->log.fd, w->log.bytes) != 0 || fdatasync(w->log.fd) != 0))\
+            goto fail;\
+    }\
+    return 0;\
+fail:;\
+    int err = errno;\
+    hmap_wal_log_close(&w->log);\
+    errno = err;\
+    return -1;\
+}\
+\
+V *hmap_wal_##K##_##V##_put(hmap_wal_##K##_##V *w, const K *key, const V *value)\
+{\
+    char *record = hmap_wal_append(&w->log, 1 + sizeof(K) + sizeof(V));\
+    record[0] = HMAP_WAL_PUT;\
+    memcpy(record + 1, key, sizeof(K));\
+    memcpy(record + 1 + sizeof(K), value, sizeof(V));\
+    V *v = hmap_##K##_##V##_put(w->h, key);\
+    *v = *value;\
+    if (hmap_wal_appended(&w->log))\
+        hmap_wal_##K##_##V##_compact(w);\
+    return v;\
+}\
+\
+void hmap_wal_##K##_##V##_put_entry(hmap_wal_##K##_##V *w, hmap_##K##_##V##_entry *entry)\
+{\
+    char *record = hmap_wal_append(&w->log, 1 + sizeof(K) + sizeof(V));\
+    record[0] = HMAP_WAL_PUT_ENTRY;\
+    memcpy(record + 1, &entry->key, sizeof(K));\
+    memcpy(record + 1 + sizeof(K), &entry->value, sizeof(V));\
+    hmap_##K##_##V##_put_entry(w->h, entry);\
+    if (hmap_wal_appended(&w->log))\
+        hmap_wal_##K##_##V##_compact(w);\
+}\
+\
+bool hmap_wal_##K##_##V##_remove(hmap_wal_##K##_##V *w, const K *key)\
+{\
+    char *record = hmap_wal_append(&w->log, 1 + sizeof(K));\
+    record[0] = HMAP_WAL_REMOVE;\
+    memcpy(record + 1, key, sizeof(K));\
+    bool removed = hmap_##K##_##V##_remove(w->h, key);\
+    if (hmap_wal_appended(&w->log))\
+        hmap_wal_##K##_##V##_compact(w);\
+    return removed;\
+}\
+\
+int hmap_wal_##K##_##V##_sync(hmap_wal_##K##_##V *w)\
+{\
+    return hmap_wal_sync(&w->log);\
+}\
+\
+int hmap_wal_##K##_##V##_compact(hmap_wal_##K##_##V *w)\
+{\
+    char *tmp = hmap_wal_path(w->log.path, ".snap.tmp");\
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);\
+    if (fd < 0) {\
+        free(tmp);\
+        return -1;\
+    }\
+    const size_t size = sizeof(K) + sizeof(V);\
+    /* a flush leaves less than HMAP_WAL_BUFFER_SIZE bytes, then one more record and the checksum are added */\
+    char *buf = malloc(HMAP_WAL_BUFFER_SIZE + size + sizeof(uint64_t));\
+    if (buf == NULL) {\
+        close(fd);\
+        unlink(tmp);\
+        free(tmp);\
+        errno = ENOMEM;\
+        return -1;\
+    }\
+    hmap_wal_snapshot_header hdr = {HMAP_WAL_SNAPSHOT_MAGIC, sizeof(K), sizeof(V), w->h->len};\
+    memcpy(buf, &hdr, sizeof(hdr));\
+    size_t len = sizeof(hdr);\
+    uint64_t off = 0, checksum = 0xcbf29ce484222325ull;\
+    int ret = 0;\
+    /* walks the inline entries too, for maps declared with HMAP_DECLARE_SMALL */\
+    uint32_t n = w->h->buckets != NULL ? w->h->cap : w->h->len;\
+    for (uint32_t i = 0; i < n; i++) {\
+        hmap_##K##_##V##_entry *e = w->h->buckets != NULL ? w->h->buckets[i] : &hmap_##K##_##V##_small(w->h)[i];\
+        for (; e != NULL; e = e->next) {\
+            memcpy(buf + len, &e->key, sizeof(K));\
+            memcpy(buf + len + sizeof(K), &e->value, sizeof(V));\
+            len += size;\
+            if (len >= HMAP_WAL_BUFFER_SIZE) {\
+                checksum = hmap_wal_checksum(checksum, buf, len);\
+                if (ret == 0)\
+                    ret = hmap_wal_write_all(fd, buf, len, off);\
+                off += len;\
+                len = 0;\
+            }\
+        }\
+    }\
+    checksum = hmap_wal_checksum(checksum, buf, len);\
+    memcpy(buf + len, &checksum, sizeof(checksum));\
+    if (ret == 0)\
+        ret = hmap_wal_write_all(fd, buf, len + sizeof(checksum), off);\
+    if (ret == 0)\
+        ret = fsync(fd);\
+    close(fd);\
+    free(buf);\
+    if (ret == 0)\
+        ret = hmap_wal_install(&w->log, tmp);\
+    if (ret != 0) {\
+        int err = errno;\
+        unlink(tmp);\
+        errno = err;\
+    }\
+    free(tmp);\
+    return ret;\
+}\
+\
+int hmap_wal_##K##_##V##_close(hmap_wal_##K##_##V *w)\
+{\
+    int ret = hmap_wal_sync(&w->log);\
+    int err = errno;\
+    hmap_wal_log_close(&w->log);\
+    errno = err;\
+    return ret;\
+}
@@ -0,0 +1,287 @@
+/*
+ * Implements a generic multimap, where every key owns an array of values.
+ * The first HMULTIMAP_INLINE_CAPACITY values are stored inside the entry, so short value lists need no allocation
+ * besides the entry and a lookup is one probe followed by a contiguous scan.
+ * Usage
+ * =====
+ * HMULTIMAP_DECLARE(K, V)
+ *     Defines structures hmultimap_K_V, hmultimap_K_V_entry and hmultimap_K_V_span, and declares the functions.
+ *     If K or V is a pointer, then it has to be typedef'd.
+ * HMULTIMAP_DEFINE(K, V, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ * HMULTIMAP_ITER_BEGIN(h, element_name)
+ *     Starts a for loop where element_name is a pointer to hmultimap_K_V_entry which can be used as iterator value.
+ *     Its values can be obtained with hmultimap_K_V_entry_values.
+ *     Modifying the multimap or entry except for the values is forbidden.
+ * HMULTIMAP_ITER_END
+ *     Ends the for loop
+ * There should not be any semicolon after the macros.
+ *
+ * Functions
+ * =========
+ * void hmultimap_K_V_init_custom(hmultimap_K_V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value)):
+ *     Initiates the multimap with given parameters. initial capacity is rounded to next power of 2.
+ *     Destructors can be NULL in which case they are ignored.
+ *
+ * void hmultimap_K_V_init(hmultimap_K_V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value)):
+ *     init_custom with default parameters + destructors forwarded.
+ *
+ * V *hmultimap_K_V_append(hmultimap_K_V *h, const K *key):
+ *     Appends a value to the key, allocating a new entry if required, and returns a pointer to it.
+ *     The pointer and earlier spans of the key are invalidated by the next append to the same key.
+ *
+ * hmultimap_K_V_span hmultimap_K_V_get_all(const hmultimap_K_V *h, const K *key):
+ *     Returns the values of the key in insertion order; data is NULL and len 0 if it doesn't exist.
+ *
+ * hmultimap_K_V_span hmultimap_K_V_entry_values(hmultimap_K_V_entry *e):
+ *     Returns the values of the entry.
+ *
+ * bool hmultimap_K_V_remove_one(hmultimap_K_V *h, const K *key, uint32_t index):
+ *     Removes the value at index of the key, calling the value destructor and keeping the order of the others.
+ *     The key is removed once its last value is. Returns true if removed, false if the key or index doesn't exist.
+ *
+ * bool hmultimap_K_V_remove(hmultimap_K_V *h, const K *key):
+ *     Removes the key with all its values, calling destructors. Returns true if removed, false if it doesn't exist.
+ *
+ * void hmultimap_K_V_destroy(hmultimap_K_V *h):
+ *     Destroys the multimap by freeing memory, and calling destructors of keys and values.
+ *
+ * Example
+ * =======
+ * HMULTIMAP_DECLARE(int, int)
+ * HMULTIMAP_DEFINE(int, int, hash_func, eq_func)
+ *
+ * hmultimap_int_int h;
+ * hmultimap_int_int_init(&h, NULL, NULL);
+ * *hmultimap_int_int_append(&h, &(int){1}) = 2;
+ * *hmultimap_int_int_append(&h, &(int){1}) = 3;
+ * hmultimap_int_int_span s = hmultimap_int_int_get_all(&h, &(int){1});
+ * printf("%" PRIu32 " %d", s.len, s.data[1]); // 2 3
+ * hmultimap_int_int_remove_one(&h, &(int){1}, 0);
+ * printf("%d", hmultimap_int_int_get_all(&h, &(int){1}).data[0]); // 3
+ * hmultimap_int_int_destroy(&h);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmap.h"
+
+#define HMULTIMAP_DEFAULT_LOAD_FACTOR      0.75
+#define HMULTIMAP_DEFAULT_INITIAL_CAPACITY 16
+#ifndef HMULTIMAP_INLINE_CAPACITY
+#define HMULTIMAP_INLINE_CAPACITY          4
+#endif
+
+#define HMULTIMAP_DECLARE(K, V) \
+typedef struct hmultimap_##K##_##V##_entry hmultimap_##K##_##V##_entry;\
+typedef struct hmultimap_##K##_##V##_entry {\
+    uint32_t                    hash;\
+    uint32_t                    len;\
+    uint32_t                    cap;\
+    K                           key;\
+    hmultimap_##K##_##V##_entry *next;\
+    union {\
+        V                       inline_values[HMULTIMAP_INLINE_CAPACITY];\
+        V                       *values;\
+    };\
+} hmultimap_##K##_##V##_entry;\
+\
+typedef struct hmultimap_##K##_##V##_span {\
+    V        *data;\
+    uint32_t len;\
+} hmultimap_##K##_##V##_span;\
+\
+typedef struct hmultimap_##K##_##V {\
+    uint32_t                    len;\
+    uint32_t                    cap;\
+    float                       load_factor;\
+    uint32_t                    threshold;\
+    void                        (*key_destructor)(K *key);\
+    void                        (*value_destructor)(V *value);\
+    hmultimap_##K##_##V##_entry **buckets;\
+} hmultimap_##K##_##V;\
+\
+static inline hmultimap_##K##_##V##_span hmultimap_##K##_##V##_entry_values(hmultimap_##K##_##V##_entry *e)\
+{\
+    V *data = e->cap > HMULTIMAP_INLINE_CAPACITY ? e->values : e->inline_values;\
+    return (hmultimap_##K##_##V##_span){data, e->len};\
+}\
+\
+void                        hmultimap_##K##_##V##_init_custom(hmultimap_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value));\
+void                        hmultimap_##K##_##V##_init(hmultimap_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value));\
+V                          *hmultimap_##K##_##V##_append(hmultimap_##K##_##V *h, const K *key);\
+hmultimap_##K##_##V##_span  hmultimap_##K##_##V##_get_all(const hmultimap_##K##_##V *h, const K *key);\
+bool                        hmultimap_##K##_##V##_remove_one(hmultimap_##K##_##V *h, const K *key, uint32_t index);\
+bool                        hmultimap_##K##_##V##_remove(hmultimap_##K##_##V *h, const K *key);\
+void                        hmultimap_##K##_##V##_destroy(hmultimap_##K##_##V *h);
+
+#define HMULTIMAP_ITER_BEGIN(h, element_name) \
+for (uint32_t element_name##i = 0; element_name##i < (h)->cap; element_name##i++) {\
+    typeof((h)->buckets[element_name##i]) element_name = (h)->buckets[element_name##i];\
+    for (; element_name != NULL; element_name = element_name->next) {
+
+#define HMULTIMAP_ITER_END \
+    }\
+}
+
+#define HMULTIMAP_DEFINE(K, V, hash_func, eq_func)\
+void hmultimap_##K##_##V##_init_custom(hmultimap_##K##_##V *h, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key), void (*value_destructor)(V *value))\
+{\
+    h->len = 0;\
+    uint32_t cap = 1;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    h->cap = cap;\
+    h->load_factor = load_factor;\
+    h->threshold = load_factor * h->cap;\
+    h->key_destructor = key_destructor;\
+    h->value_destructor = value_destructor;\
+    h->buckets = calloc(h->cap, sizeof(*h->buckets));\
+}\
+\
+void hmultimap_##K##_##V##_init(hmultimap_##K##_##V *h, void (*key_destructor)(K *key), void (*value_destructor)(V *value))\
+{\
+    hmultimap_##K##_##V##_init_custom(h, HMULTIMAP_DEFAULT_LOAD_FACTOR, HMULTIMAP_DEFAULT_INITIAL_CAPACITY, key_destructor, value_destructor);\
+}\
+\
+static uint32_t hmultimap_##K##_##V##_hash(const K *key) \
+{\
+    return hmap_mix(hash_func(key));\
+}\
+\
+static void hmultimap_##K##_##V##_resize(hmultimap_##K##_##V *h) \
+{\
+    hmultimap_##K##_##V new = *h;\
+    new.cap <<= 1;\
+    new.threshold = new.load_factor * new.cap;\
+    new.buckets = calloc(new.cap, sizeof(*new.buckets));\
+\
+    for (uint32_t i = 0; i < h->cap; i++) {\
+        hmultimap_##K##_##V##_entry *e = h->buckets[i];\
+        while (e != NULL) {\
+            hmultimap_##K##_##V##_entry *next = e->next;\
+            uint32_t new_hash = e->hash & (new.cap - 1);\
+            e->next = new.buckets[new_hash];\
+            new.buckets[new_hash] = e;\
+            e = next;\
+        }\
+    }\
+    free(h->buckets);\
+    *h = new;\
+}\
+\
+static void hmultimap_##K##_##V##_destroy_entry(hmultimap_##K##_##V *h, hmultimap_##K##_##V##_entry *e)\
+{\
+    hmultimap_##K##_##V##_span values = hmultimap_##K##_##V##_entry_values(e);\
+    if (h->key_destructor != NULL) h->key_destructor(&e->key);\
+    if (h->value_destructor != NULL) {\
+        for (uint32_t i = 0; i < values.len; i++)\
+            h->value_destructor(&values.data[i]);\
+    }\
+    if (e->cap > HMULTIMAP_INLINE_CAPACITY) free(e->values);\
+    free(e);\
+}\
+\
+static hmultimap_##K##_##V##_entry **hmultimap_##K##_##V##_find(const hmultimap_##K##_##V *h, const K *key, uint32_t hash)\
+{\
+    uint32_t index = hash & (h->cap - 1);\
+    hmultimap_##K##_##V##_entry **e = &h->buckets[index];\
+    for (; *e != NULL; e = &(*e)->next) {\
+        if ((*e)->hash == hash && eq_func(&(*e)->key, key)) {\
+            break;\
+        }\
+    }\
+    return e;\
+}\
+\
+V *hmultimap_##K##_##V##_append(hmultimap_##K##_##V *h, const K *key)\
+{\
+    if (h->len >= h->threshold) {\
+        hmultimap_##K##_##V##_resize(h);\
+    }\
+    uint32_t hash = hmultimap_##K##_##V##_hash(key);\
+    hmultimap_##K##_##V##_entry **prev_next = hmultimap_##K##_##V##_find(h, key, hash);\
+    hmultimap_##K##_##V##_entry *e = *prev_next;\
+    if (e == NULL) {\
+        e = malloc(sizeof(*e));\
+        e->hash = hash;\
+        e->len = 0;\
+        e->cap = HMULTIMAP_INLINE_CAPACITY;\
+        e->key = *key;\
+        e->next = NULL;\
+        *prev_next = e;\
+        h->len++;\
+    }\
+    if (e->len == e->cap) {\
+        /* spill from inline storage, or grow the heap array */\
+        V *values = malloc(2 * e->cap * sizeof(*values));\
+        memcpy(values, hmultimap_##K##_##V##_entry_values(e).data, e->len * sizeof(*values));\
+        if (e->cap > HMULTIMAP_INLINE_CAPACITY) free(e->values);\
+        e->values = values;\
+        e->cap *= 2;\
+    }\
+    return &hmultimap_##K##_##V##_entry_values(e).data[e->len++];\
+}\
+\
+hmultimap_##K##_##V##_span hmultimap_##K##_##V##_get_all(const hmultimap_##K##_##V *h, const K *key)\
+{\
+    uint32_t hash = hmultimap_##K##_##V##_hash(key);\
+    hmultimap_##K##_##V##_entry *e = *hmultimap_##K##_##V##_find(h, key, hash);\
+    if (e == NULL)\
+        return (hmultimap_##K##_##V##_span){NULL, 0};\
+    return hmultimap_##K##_##V##_entry_values(e);\
+}\
+\
+bool hmultimap_##K##_##V##_remove_one(hmultimap_##K##_##V *h, const K *key, uint32_t index)\
+{\
+    uint32_t hash = hmultimap_##K##_##V##_hash(key);\
+    hmultimap_##K##_##V##_entry **prev_next = hmultimap_##K##_##V##_find(h, key, hash);\
+    hmultimap_##K##_##V##_entry *e = *prev_next;\
+    if (e == NULL || index >= e->len)\
+        return false;\
+    if (e->len == 1) {\
+        *prev_next = e->next;\
+        h->len--;\
+        hmultimap_##K##_##V##_destroy_entry(h, e);\
+        return true;\
+    }\
+    V *values = hmultimap_##K##_##V##_entry_values(e).data;\
+    if (h->value_destructor != NULL) h->value_destructor(&values[index]);\
+    memmove(&values[index], &values[index + 1], (e->len - index - 1) * sizeof(*values));\
+    e->len--;\
+    return true;\
+}\
+\
+bool hmultimap_##K##_##V##_remove(hmultimap_##K##_##V *h, const K *key)\
+{\
+    uint32_t hash = hmultimap_##K##_##V##_hash(key);\
+    hmultimap_##K##_##V##_entry **prev_next = hmultimap_##K##_##V##_find(h, key, hash);\
+    hmultimap_##K##_##V##_entry *e = *prev_next;\
+    if (e == NULL)\
+        return false;\
+    *prev_next = e->next;\
+    h->len--;\
+    hmultimap_##K##_##V##_destroy_entry(h, e);\
+    return true;\
+}\
+\
+void hmultimap_##K##_##V##_destroy(hmultimap_##K##_##V *h)\
+{\
+    for (uint32_t i = 0; i < h->cap; i++) {\
+        hmultimap_##K##_##V##_entry *e = h->buckets[i];\
+        while (e != NULL) {\
+            hmultimap_##K##_##V##_entry *next = e->next;\
+            hmultimap_##K##_##V##_destroy_entry(h, e);\
+            e = next;\
+        }\
+    }\
+    free(h->buckets);\
+}
@@ -0,0 +1,318 @@
+/*
+ * Implements a generic hashset.
+ * Unlike hmap_K_bool, there is no value field and no per-entry allocation: keys and their hashes are kept in two
+ * flat arrays probed linearly, and removal shifts following keys back instead of leaving tombstones.
+ * Usage
+ * =====
+ * HSET_DECLARE(K)
+ *     Defines structure hset_K, and declares the functions.
+ *     If K is a pointer, then it has to be typedef'd.
+ * HSET_DEFINE(K, hash_func, eq_func)
+ *     Defines the functions.
+ *     hash_func: Must have signature: uint32_t hash_func(const K *)
+ *     eq_func:   Must have signature: bool eq_func(const K *, const K *)
+ * HSET_ITER_BEGIN(s, element_name)
+ *     Starts a for loop where element_name is a pointer to K which can be used as iterator value.
+ *     Modifying the hashset or the key is forbidden.
+ * HSET_ITER_END
+ *     Ends the for loop
+ * There should not be any semicolon after the macros.
+ *
+ * Functions
+ * =========
+ * void hset_K_init_custom(hset_K *s, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key)):
+ *     Initiates the hashset with given parameters. initial capacity is rounded to next power of 2.
+ *     load_factor must be less than 1. Destructor can be NULL in which case it is ignored.
+ *
+ * void hset_K_init(hset_K *s, void (*key_destructor)(K *key)):
+ *     init_custom with default parameters + destructor forwarded.
+ *
+ * bool hset_K_add(hset_K *s, const K *key):
+ *     Adds the key. Returns true if it was added, false if an equal key was already present (the set is unchanged).
+ *
+ * K *hset_K_put(hset_K *s, const K *key):
+ *     Adds the key if no equal key is present, and returns a pointer to the stored key. s->len grows if it was added.
+ *     The stored key may be modified as long as its hash and equality with other keys stay the same.
+ *
+ * bool hset_K_contains(const hset_K *s, const K *key):
+ *     Returns whether the key is present.
+ *
+ * K *hset_K_get(const hset_K *s, const K *key):
+ *     Gets a pointer to the stored key equal to key; returns NULL if it doesn't exist.
+ *     Useful when K carries data that eq_func ignores.
+ *
+ * bool hset_K_remove(hset_K *s, const K *key):
+ *     Removes the key from the set, calling the destructor on the stored key.
+ *     Returns true if removed, false if it doesn't exist.
+ *
+ * void hset_K_union(hset_K *dst, const hset_K *src, void (*key_copy)(K *dst, const K *src)):
+ *     Adds every key of src missing from dst. Keys are copied with key_copy, or bitwise if it is NULL.
+ *
+ * void hset_K_intersect(hset_K *dst, const hset_K *src):
+ *     Removes every key of dst missing from src, calling the destructor of dst.
+ *
+ * void hset_K_difference(hset_K *dst, const hset_K *src):
+ *     Removes every key of dst present in src, calling the destructor of dst.
+ *
+ *     Set operations reuse the stored hashes of the other set, so hash_func is not called.
+ *
+ * void hset_K_destroy(hset_K *s):
+ *     Destroys the set by freeing memory, and calling destructor of keys.
+ *
+ * Example
+ * =======
+ * HSET_DECLARE(int)
+ * HSET_DEFINE(int, hash_func, eq_func)
+ *
+ * hset_int a, b;
+ * hset_int_init(&a, NULL);
+ * hset_int_init(&b, NULL);
+ * hset_int_add(&a, &(int){1});
+ * hset_int_add(&a, &(int){2});
+ * hset_int_add(&b, &(int){2});
+ * hset_int_difference(&a, &b);
+ * printf("%d", hset_int_contains(&a, &(int){1})); // 1
+ * printf("%" PRIu32, a.len); // 1
+ * hset_int_destroy(&a);
+ * hset_int_destroy(&b);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hmap.h"
+
+#define HSET_DEFAULT_LOAD_FACTOR      0.75
+#define HSET_DEFAULT_INITIAL_CAPACITY 16
+
+/* stored hashes always have this bit set, so that 0 can mark an empty slot */
+#define HSET_HASH_USED 0x80000000u
+
+#define HSET_DECLARE(K) \
+typedef struct hset_##K {\
+    uint32_t len;\
+    uint32_t cap;\
+    float    load_factor;\
+    uint32_t threshold;\
+    void     (*key_destructor)(K *key);\
+    uint32_t *hashes;\
+    K        *keys;\
+} hset_##K;\
+\
+void hset_##K##_init_custom(hset_##K *s, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key));\
+void hset_##K##_init(hset_##K *s, void (*key_destructor)(K *key));\
+bool hset_##K##_add(hset_##K *s, const K *key);\
+K   *hset_##K##_put(hset_##K *s, const K *key);\
+bool hset_##K##_contains(const hset_##K *s, const K *key);\
+K   *hset_##K##_get(const hset_##K *s, const K *key);\
+bool hset_##K##_remove(hset_##K *s, const K *key);\
+void hset_##K##_union(hset_##K *dst, const hset_##K *src, void (*key_copy)(K *dst, const K *src));\
+void hset_##K##_intersect(hset_##K *dst, const hset_##K *src);\
+void hset_##K##_difference(hset_##K *dst, const hset_##K *src);\
+void hset_##K##_destroy(hset_##K *s);
+
+#define HSET_ITER_BEGIN(s, element_name) \
+for (uint32_t element_name##i = 0; element_name##i < (s)->cap; element_name##i++) {\
+    if ((s)->hashes[element_name##i] == 0) continue;\
+    typeof(&(s)->keys[0]) element_name = &(s)->keys[element_name##i];\
+    {
+
+#define HSET_ITER_END \
+    }\
+}
+
+#define HSET_DEFINE(K, hash_func, eq_func)\
+void hset_##K##_init_custom(hset_##K *s, float load_factor, uint32_t initial_capacity, void (*key_destructor)(K *key))\
+{\
+    s->len = 0;\
+    uint32_t cap = 1;\
+    while (cap < initial_capacity)\
+        cap <<= 1;\
+    s->cap = cap;\
+    s->load_factor = load_factor;\
+    s->threshold = load_factor * s->cap;\
+    s->key_destructor = key_destructor;\
+    s->hashes = calloc(s->cap, sizeof(*s->hashes));\
+    s->keys = malloc(s->cap * sizeof(*s->keys));\
+}\
+\
+void hset_##K##_init(hset_##K *s, void (*key_destructor)(K *key))\
+{\
+    hset_##K##_init_custom(s, HSET_DEFAULT_LOAD_FACTOR, HSET_DEFAULT_INITIAL_CAPACITY, key_destructor);\
+}\
+\
+static uint32_t hset_##K##_hash(const K *key) \
+{\
+    return hmap_mix(hash_func(key)) | HSET_HASH_USED;\
+}\
+\
+/* returns the slot holding key, or the empty slot where it would go */\
+static uint32_t hset_##K##_slot(const hset_##K *s, const K *key, uint32_t hash)\
+{\
+    uint32_t mask = s->cap - 1;\
+    uint32_t i = hash & mask;\
+    for (; s->hashes[i] != 0; i = (i + 1) & mask) {\
+        if (s->hashes[i] == hash && eq_func(&s->keys[i], key)) {\
+            break;\
+        }\
+    }\
+    return i;\
+}\
+\
+/* inserts a key known to be absent */\
+static void hset_##K##_insert_new(hset_##K *s, const K *key, uint32_t hash)\
+{\
+    uint32_t mask = s->cap - 1;\
+    uint32_t i = hash & mask;\
+    while (s->hashes[i] != 0)\
+        i = (i + 1) & mask;\
+    s->hashes[i] = hash;\
+    s->keys[i] = *key;\
+}\
+\
+static void hset_##K##_resize(hset_##K *s) \
+{\
+    hset_##K new = *s;\
+    new.cap <<= 1;\
+    new.threshold = new.load_factor * new.cap;\
+    new.hashes = calloc(new.cap, sizeof(*new.hashes));\
+    new.keys = malloc(new.cap * sizeof(*new.keys));\
+    for (uint32_t i = 0; i < s->cap; i++) {\
+        if (s->hashes[i] != 0) {\
+            hset_##K##_insert_new(&new, &s->keys[i], s->hashes[i]);\
+        }\
+    }\
+    free(s->hashes);\
+    free(s->keys);\
+    *s = new;\
+}\
+\
+static void hset_##K##_resize_if_required(hset_##K *s)\
+{\
+    if (s->len >= s->threshold) {\
+        hset_##K##_resize(s);\
+    }\
+}\
+\
+/* removes slot i, shifting back the keys of the probe run that follows so no tombstone is needed */\
+static void hset_##K##_remove_slot(hset_##K *s, uint32_t i)\
+{\
+    uint32_t mask = s->cap - 1;\
+    if (s->key_destructor != NULL) s->key_destructor(&s->keys[i]);\
+    uint32_t j = i;\
+    for (;;) {\
+        j = (j + 1) & mask;\
+        if (s->hashes[j] == 0)\
+            break;\
+        uint32_t home = s->hashes[j] & mask;\
+        /* keys whose home lies cyclically in (i, j] must stay */\
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))\
+            continue;\
+        s->hashes[i] = s->hashes[j];\
+        s->keys[i] = s->keys[j];\
+        i = j;\
+    }\
+    s->hashes[i] = 0;\
+    s->len--;\
+}\
+\
+K *hset_##K##_put(hset_##K *s, const K *key)\
+{\
+    hset_##K##_resize_if_required(s);\
+    uint32_t hash = hset_##K##_hash(key);\
+    uint32_t i = hset_##K##_slot(s, key, hash);\
+    if (s->hashes[i] == 0) {\
+        s->hashes[i] = hash;\
+        s->keys[i] = *key;\
+        s->len++;\
+    }\
+    return &s->keys[i];\
+}\
+\
+bool hset_##K##_add(hset_##K *s, const K *key)\
+{\
+    uint32_t len = s->len;\
+    hset_##K##_put(s, key);\
+    return s->len != len;\
+}\
+\
+bool hset_##K##_contains(const hset_##K *s, const K *key)\
+{\
+    return hset_##K##_get(s, key) != NULL;\
+}\
+\
+K *hset_##K##_get(const hset_##K *s, const K *key)\
+{\
+    uint32_t hash = hset_##K##_hash(key);\
+    uint32_t i = hset_##K##_slot(s, key, hash);\
+    return s->hashes[i] != 0 ? &s->keys[i] : NULL;\
+}\
+\
+bool hset_##K##_remove(hset_##K *s, const K *key)\
+{\
+    uint32_t hash = hset_##K##_hash(key);\
+    uint32_t i = hset_##K##_slot(s, key, hash);\
+    if (s->hashes[i] == 0)\
+        return false;\
+    hset_##K##_remove_slot(s, i);\
+    return true;\
+}\
+\
+void hset_##K##_union(hset_##K *dst, const hset_##K *src, void (*key_copy)(K *dst, const K *src))\
+{\
+    for (uint32_t i = 0; i < src->cap; i++) {\
+        uint32_t hash = src->hashes[i];\
+        if (hash == 0)\
+            continue;\
+        hset_##K##_resize_if_required(dst);\
+        uint32_t j = hset_##K##_slot(dst, &src->keys[i], hash);\
+        if (dst->hashes[j] != 0)\
+            continue;\
+        dst->hashes[j] = hash;\
+        if (key_copy != NULL)\
+            key_copy(&dst->keys[j], &src->keys[i]);\
+        else\
+            dst->keys[j] = src->keys[i];\
+        dst->len++;\
+    }\
+}\
+\
+/* removes keys of dst whose presence in src equals keep_if_present's negation */\
+static void hset_##K##_filter(hset_##K *dst, const hset_##K *src, bool keep_if_present)\
+{\
+    for (uint32_t i = 0; i < dst->cap; i++) {\
+        /* a removal shifts the next key into slot i, so check it again */\
+        while (dst->hashes[i] != 0) {\
+            uint32_t hash = dst->hashes[i];\
+            bool present = src->hashes[hset_##K##_slot(src, &dst->keys[i], hash)] != 0;\
+            if (present == keep_if_present)\
+                break;\
+            hset_##K##_remove_slot(dst, i);\
+        }\
+    }\
+}\
+\
+void hset_##K##_intersect(hset_##K *dst, const hset_##K *src)\
+{\
+    hset_##K##_filter(dst, src, true);\
+}\
+\
+void hset_##K##_difference(hset_##K *dst, const hset_##K *src)\
+{\
+    hset_##K##_filter(dst, src, false);\
+}\
+\
+void hset_##K##_destroy(hset_##K *s)\
+{\
+    if (s->key_destructor != NULL) {\
+        for (uint32_t i = 0; i < s->cap; i++) {\
+            if (s->hashes[i] != 0) s->key_destructor(&s->keys[i]);\
+        }\
+    }\
+    free(s->hashes);\
+    free(s->keys);\
+}